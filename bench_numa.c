@@ -0,0 +1,85 @@
+// Compares a plain channel with a NUMA-local one when the producer and the
+// consumer run on different NUMA nodes.  On single node systems both runs
+// are on the same node and should perform the same.
+// mpsc.h defines _DEFAULT_SOURCE for MPSC_NUMA so it must come first.
+#define MPSC_NUMA
+#define MPSC_IMPLEMENTATION
+#include "mpsc.h"
+
+enum { COUNT = 1000000, ROUNDS = 5 };
+
+struct message {
+    long values[32];
+};
+
+static int producer_node;
+
+int producer(SENDER(struct message) tx) {
+    mpsc_numa_pin_thread(producer_node);
+    struct message msg = {0};
+    for (long n = 0; n < COUNT; n++) {
+        msg.values[0] = n;
+        MPSC_SEND(tx, msg);
+    }
+    MPSC_DROP_SENDER(tx);
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double run(int numa) {
+    SENDER(struct message) tx;
+    RECEIVER(struct message) rx;
+    if (numa) {
+        MPSC_CHANNEL_NUMA(tx, rx, MPSC_NUMA_LOCAL);
+    } else {
+        MPSC_CHANNEL(tx, rx);
+    }
+    const double start = now();
+    thrd_t thread;
+    thrd_create(&thread, (thrd_start_t)producer, tx);
+    struct message msg;
+    long sum = 0;
+    while (MPSC_RECV(rx, msg) == mpsc_OK) {
+        for (int i = 0; i < 32; i++) {
+            sum += msg.values[i];
+        }
+    }
+    const double elapsed = now() - start;
+    thrd_join(thread, NULL);
+    MPSC_DROP_RECEIVER(rx);
+    if (sum != (long)COUNT * (COUNT - 1) / 2) {
+        fprintf(stderr, "bad checksum\n");
+    }
+    return elapsed;
+}
+
+int main(void) {
+    const int nodes = mpsc_numa_node_count();
+    const int consumer_node = 0;
+    producer_node = nodes - 1;
+    if (mpsc_numa_pin_thread(consumer_node) != 0) {
+        fprintf(stderr, "could not pin the consumer, results may be noisy\n");
+    }
+    printf(
+        "nodes: %d, consumer on node %d, producer on node %d\n",
+        nodes, consumer_node, producer_node
+    );
+    for (int numa = 0; numa <= 1; numa++) {
+        double best = 1e9;
+        for (int r = 0; r < ROUNDS; r++) {
+            const double t = run(numa);
+            if (t < best) {
+                best = t;
+            }
+        }
+        printf(
+            "%-10s %8.3f s  %8.1f ns/msg\n",
+            numa ? "numa-local" : "default", best, best * 1e9 / COUNT
+        );
+    }
+}
@@ -1,7 +1,19 @@
 /* https://github.com/JaMo42/mpsc.h */
 #ifndef MPSC_H
 #define MPSC_H
+#if defined(MPSC_NUMA) && defined(__linux__)
+#define MPSC__NUMA
+// Needed for `syscall`, `mmap`, and `sysconf` when compiling with a strict
+// `-std=c*` mode.  This only works if mpsc.h is included before any system
+// header, otherwise define it when compiling; the `-std=gnu*` modes already
+// define it.
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#endif
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
@@ -30,11 +42,110 @@ struct mpsc_queue_node {
     char data[];
 };
 
+/// Stored in front of the data of every node of a keyed queue.
+struct mpsc_queue_key {
+    /// Next node in the same hash bucket.
+    struct mpsc_queue_node *chain;
+    uint64_t key;
+    /// Whether the node is in the hash table, nodes sent without a key are
+    /// never conflated.
+    int hashed;
+};
+
+/// A node waiting in the timer heap of a queue until its deadline.
+struct mpsc_queue_timer {
+    struct timespec deadline;
+    /// Send order, keeps nodes with the same deadline in FIFO order.
+    uint64_t seq;
+    struct mpsc_queue_node *node;
+};
+
+/// A spill file, see `MPSC_CHANNEL_SPILL`.
+struct mpsc_spill_segment {
+    struct mpsc_spill_segment *next;
+    FILE *file;
+    /// Number of records written to and read back from the file.
+    size_t written;
+    size_t read;
+};
+
+/// A batch of spilled records that is not written to a segment yet.
+struct mpsc_spill_batch {
+    struct mpsc_spill_batch *next;
+    size_t count;
+    char data[];
+};
+
+/// Spill state of a queue.  Everything is protected by the queue mutex, file
+/// IO is done without holding it: full batches are written by a writer thread
+/// and the receiver reads segments back itself.
+struct mpsc_spill {
+    size_t threshold;
+    /// Records per segment, a multiple of `MPSC_SPILL_BATCH`.
+    size_t segment_records;
+    /// Number of spilled records that were not received yet.
+    size_t count;
+    /// Segments that were not fully read yet, oldest first; the last one is
+    /// the one being written to.
+    struct mpsc_spill_segment *segments;
+    struct mpsc_spill_segment *segments_tail;
+    /// Fully read segments for the writer to reuse or close.
+    struct mpsc_spill_segment *retired;
+    /// Full batches waiting for the writer, oldest first.
+    struct mpsc_spill_batch *pending;
+    struct mpsc_spill_batch *pending_tail;
+    /// Batch senders currently spill into, `NULL` if there is none.
+    struct mpsc_spill_batch *batch;
+    /// Set while the writer writes the first pending batch.
+    int writing;
+    /// Set while a receiver reads from the first segment.
+    int reading;
+    /// Set once writing failed, pending batches then just stay in memory.
+    int failed;
+    int stop;
+    /// Prefix for segment file names, `NULL` to use `tmpfile`.
+    char *path;
+    unsigned next_file;
+    /// Serializes IO on the segments between the writer and the receiver.
+    mtx_t io;
+    /// Wakes up the writer.
+    cnd_t cond;
+    thrd_t writer;
+    int has_writer;
+};
+
+/// A block of nodes allocated at once, used for NUMA-local queues.
+struct mpsc_queue_chunk {
+    struct mpsc_queue_chunk *next;
+    size_t size;
+    int mapped;
+};
+
 struct mpsc_queue {
     struct mpsc_queue_node *head;
     struct mpsc_queue_node *tail;
     struct mpsc_queue_node *freelist;
+    struct mpsc_queue_chunk *chunks;
     size_t datasize;
+    /// Size of the `mpsc_queue_key` header in front of the data, 0 if the queue
+    /// is not keyed.
+    size_t headersize;
+    /// Hash table of pending keyed nodes, by key.
+    struct mpsc_queue_node **buckets;
+    size_t bucket_count;
+    size_t key_count;
+    /// Min-heap of nodes sent with a deadline, by deadline.
+    struct mpsc_queue_timer *timers;
+    size_t timer_count;
+    size_t timer_capacity;
+    uint64_t timer_seq;
+    /// Number of nodes in the list from `head` to `tail`.
+    size_t length;
+    /// Spill state, `NULL` if spilling is disabled.
+    struct mpsc_spill *spill;
+    /// NUMA node the nodes are allocated on, or `MPSC_NUMA_NONE` to just use
+    /// `malloc`.
+    int numa_node;
     mtx_t mutex;
     cnd_t cond;
     atomic_size_t senders;
@@ -58,6 +169,61 @@ struct mpsc_receiver {
     struct mpsc_shared_queue queue;
 };
 
+/// Processes one item in a pipeline stage, returns non-zero if `output` should
+/// be sent to the next stage.  `output` is `NULL` for the last stage.  Called
+/// concurrently if the stage has multiple threads.
+typedef int (*mpsc_stage_fn)(void *context, const void *input, void *output);
+
+/// A pipeline stage, see `mpsc_pipeline_add_stage`.
+struct mpsc_stage {
+    mpsc_stage_fn fn;
+    void *context;
+    struct mpsc_receiver *input;
+    /// `NULL` for the last stage.
+    struct mpsc_sender *output;
+    struct mpsc_pipeline *pipeline;
+    /// Protects everything below and the `input` and `output` pointers once
+    /// the stage is running.
+    mtx_t mutex;
+    thrd_t *threads;
+    size_t thread_count;
+    size_t max_threads;
+    /// Number of threads that did not exit yet, once this reaches 0 the input
+    /// and output are dropped, which closes the channel to the next stage.
+    size_t running;
+    int started;
+    atomic_uint_least64_t processed;
+    /// Number of threads that could not be pinned.
+    atomic_size_t unpinned;
+    /// `processed` and time at the previous `mpsc_pipeline_stats` call, the
+    /// throughput is measured from there.
+    uint64_t window_processed;
+    struct timespec window_start;
+};
+
+struct mpsc_pipeline {
+    struct mpsc_stage **stages;
+    size_t stage_count;
+    size_t stage_capacity;
+    struct timespec start;
+    /// Whether to pin every thread to its own CPU.
+    int pin;
+    atomic_uint next_cpu;
+};
+
+/// Statistics of a pipeline stage, see `mpsc_pipeline_stats`.
+struct mpsc_stage_stats {
+    size_t threads;
+    uint64_t processed;
+    /// Items processed per second since the previous call of
+    /// `mpsc_pipeline_stats` for the stage, or since the pipeline was started.
+    double throughput;
+    /// Items waiting in the input channel.
+    size_t depth;
+    /// Number of threads that failed to be pinned to their CPU.
+    size_t unpinned;
+};
+
 #define MPSC__STATIC_ASSERT_EXPR(_expr, _msg) \
     (sizeof(struct { _Static_assert((_expr), _msg); char _; }))
 
@@ -67,6 +233,46 @@ struct mpsc_receiver {
         "channel/target type mismatch" \
     ))
 
+/// Do not place the queue on any specific NUMA node.
+#define MPSC_NUMA_NONE (-1)
+/// Place the queue on the NUMA node of the thread creating it.
+#define MPSC_NUMA_LOCAL (-2)
+
+/// Number of nodes allocated at once for NUMA-local queues.
+#ifndef MPSC_NUMA_CHUNK_NODES
+#define MPSC_NUMA_CHUNK_NODES 64
+#endif
+
+/// Number of records written to or read from the spill file at once.
+#ifndef MPSC_SPILL_BATCH
+#define MPSC_SPILL_BATCH 256
+#endif
+
+/// Approximate size of a spill segment file in bytes, segments are reused or
+/// deleted once they are read back.
+#ifndef MPSC_SPILL_SEGMENT_SIZE
+#define MPSC_SPILL_SEGMENT_SIZE (4 << 20)
+#endif
+
+/// Number of items a pipeline stage receives and sends at once.
+#ifndef MPSC_PIPELINE_BATCH
+#define MPSC_PIPELINE_BATCH 64
+#endif
+
+/// Creates a channel from the shared queue expression, which can use the size
+/// of the receivers type.
+#define MPSC__CHANNEL_FROM(_sident, _rident, _queue_expr) \
+    ( \
+        ((void)(MPSC__STATIC_ASSERT_EXPR( \
+            __builtin_types_compatible_p(typeof(*_sident), typeof(*_rident)), \
+            "sender and receiver have incompatible types" \
+        ))), \
+        _rident = (typeof(_rident))mpsc_receiver_new(_queue_expr), \
+        _sident = (typeof(_sident))mpsc_sender_new( \
+            mpsc_shared_queue_clone(((struct mpsc_receiver*)_rident)->queue) \
+        ) \
+    )
+
 #define SENDER(T) T*
 
 #define RECEIVER(T) T*
@@ -81,19 +287,74 @@ struct mpsc_receiver {
 /// MPSC_CHANNEL(sender, receiver);
 /// ```
 #define MPSC_CHANNEL(_sident, _rident) \
-    ( \
-        ((void)(MPSC__STATIC_ASSERT_EXPR( \
-            __builtin_types_compatible_p(typeof(*_sident), typeof(*_rident)), \
-            "sender and receiver have incompatible types" \
-        ))), \
-        _rident = (typeof(_rident))mpsc_receiver_new( \
-            mpsc_shared_queue_new(sizeof(*_rident)) \
-        ), \
-        _sident = (typeof(_sident))mpsc_sender_new( \
-            mpsc_shared_queue_clone(((struct mpsc_receiver*)_rident)->queue) \
-        ) \
+    MPSC__CHANNEL_FROM( \
+        _sident, _rident, mpsc_shared_queue_new(sizeof(*_rident)) \
     )
 
+/// Like `MPSC_CHANNEL` but the memory of the queue is allocated on the given
+/// NUMA node.  This should be the node the receiving thread runs on, so the
+/// receiver does not take remote cache misses when reading the data; use
+/// `MPSC_NUMA_LOCAL` to use the node of the calling thread.  Only has an effect
+/// if `MPSC_NUMA` is defined, the system is Linux, and the system actually has
+/// multiple NUMA nodes, otherwise this is the same as `MPSC_CHANNEL`.
+///
+/// Example
+/// -------
+/// ```c
+/// int *sender, *receiver;
+/// MPSC_CHANNEL_NUMA(sender, receiver, MPSC_NUMA_LOCAL);
+/// MPSC_PIN_RECEIVER(receiver);  // keep the receiving thread on that node
+/// ```
+#define MPSC_CHANNEL_NUMA(_sident, _rident, _node) \
+    MPSC__CHANNEL_FROM( \
+        _sident, _rident, mpsc_shared_queue_new_numa(sizeof(*_rident), _node) \
+    )
+
+/// Like `MPSC_CHANNEL` but creates a conflating channel: data sent with
+/// `MPSC_SEND_KEYED` replaces pending data with the same key instead of being
+/// appended, so the receiver only gets the latest value for each key, in the
+/// order the keys were first sent since they were last received.
+///
+/// Example
+/// -------
+/// ```c
+/// int *sender, *receiver;
+/// MPSC_CHANNEL_KEYED(sender, receiver);
+/// int a = 1, b = 2;
+/// MPSC_SEND_KEYED(sender, 7, a);
+/// MPSC_SEND_KEYED(sender, 7, b);  // replaces `a`
+/// ```
+#define MPSC_CHANNEL_KEYED(_sident, _rident) \
+    MPSC__CHANNEL_FROM( \
+        _sident, _rident, mpsc_shared_queue_new_keyed(sizeof(*_rident)) \
+    )
+
+/// Like `MPSC_CHANNEL` but once more than `_threshold` items are waiting in
+/// memory, further items are written to segment files and read back in order
+/// once the in-memory items are received.  This keeps memory usage bounded
+/// without blocking senders or dropping data.  Senders only fill batches in
+/// memory, a background thread writes them to the files.  The path is the
+/// prefix for the segment file names, which are deleted right after opening
+/// them, or is `NULL` to use `tmpfile`.  If a file can't be opened or written
+/// the channel just keeps everything in memory.
+///
+/// Example
+/// -------
+/// ```c
+/// int *sender, *receiver;
+/// MPSC_CHANNEL_SPILL(sender, receiver, 100000, NULL);
+/// ```
+#define MPSC_CHANNEL_SPILL(_sident, _rident, _threshold, _path) \
+    MPSC__CHANNEL_FROM( \
+        _sident, _rident, mpsc_shared_queue_new_spill(sizeof(*_rident), _threshold, _path) \
+    )
+
+/// Pins the calling thread to the CPUs of the NUMA node the receivers queue
+/// was allocated on.  Returns 0 on success and -1 if the queue is not NUMA-local
+/// or pinning is not supported.
+#define MPSC_PIN_RECEIVER(_rident) \
+    (mpsc_receiver_numa_pin((struct mpsc_receiver*)_rident))
+
 /// Creates a new sender for the channel of the given receiver.
 ///
 /// Example
@@ -166,6 +427,36 @@ struct mpsc_receiver {
     (MPSC__TYPECHECK(_sident, &_data), \
     mpsc_sender_send((struct mpsc_sender*)_sident, (void*)&_data))
 
+/// Sends data with the given key over a channel created with
+/// `MPSC_CHANNEL_KEYED`.  If data with the same key has not been received yet
+/// it is overwritten in place.  See MPSC_SEND for more information.
+#define MPSC_SEND_KEYED(_sident, _key, _data) \
+    (MPSC__TYPECHECK(_sident, &_data), \
+    mpsc_sender_send_keyed((struct mpsc_sender*)_sident, _key, (void*)&_data))
+
+/// Sends data over the channel that is only received once the deadline has
+/// passed.  The deadline is a pointer to an absolute `TIME_UTC` time point, the
+/// same as for `MPSC_RECV_TIMEOUT`.  The receiver waits until the earliest
+/// deadline on its own so no extra thread is needed for delayed data.  Data
+/// with a deadline is still received after all senders are dropped.
+/// See MPSC_SEND for more information.
+///
+/// Example
+/// -------
+/// ```c
+/// int *sender, *receiver;
+/// MPSC_CHANNEL(sender, receiver);
+/// struct timespec deadline;
+/// timespec_get(&deadline, TIME_UTC);
+/// deadline.tv_sec += 2;
+/// int data = 12;
+/// MPSC_SEND_AT(sender, data, &deadline);
+/// MPSC_RECV(receiver, data);  // after 2 seconds
+/// ```
+#define MPSC_SEND_AT(_sident, _data, _deadline) \
+    (MPSC__TYPECHECK(_sident, &_data), \
+    mpsc_sender_send_at((struct mpsc_sender*)_sident, (void*)&_data, _deadline))
+
 /// Receives data over the channel.  The data parameter is the identifier of a
 /// value, not a pointer to it.  Returns mpsc_CLOSED if the other half of the
 /// channel is disconnected, and leaves the data unchanged.
@@ -190,43 +481,179 @@ struct mpsc_receiver {
     (MPSC__TYPECHECK(_rident, &_data), \
     mpsc_receiver_try_recv((struct mpsc_receiver*)_rident, (void*)&_data))
 
+/// Receives data and its key over a channel created with `MPSC_CHANNEL_KEYED`.
+/// The key parameter is the identifier of a `uint64_t`, data sent without a
+/// key has the key 0.  See MPSC_RECV for more information.
+#define MPSC_RECV_KEYED(_rident, _key, _data) \
+    (MPSC__TYPECHECK(_rident, &_data), \
+    ((void)MPSC__STATIC_ASSERT_EXPR( \
+        __builtin_types_compatible_p(typeof(_key), uint64_t), \
+        "key must be a uint64_t" \
+    )), \
+    mpsc_receiver_recv_keyed((struct mpsc_receiver*)_rident, &_key, (void*)&_data))
+
 /// Receives data over the channel with a timeout, returns mpsc_TIMEOUT if the
 /// timeout is reached.  See MPSC_RECV for more information.
 #define MPSC_RECV_TIMEOUT(_rident, _data, _timeout) \
     (MPSC__TYPECHECK(_rident, &_data), \
     mpsc_receiver_recv_timeout((struct mpsc_receiver*)_rident, (void*)&_data, _timeout))
 
+/// Adds a stage to a pipeline, see `mpsc_pipeline_add_stage`.  The receiver
+/// and sender are given to the pipeline and set to NULL.  Use
+/// `MPSC_PIPELINE_ADD_SINK` for the last stage.
+///
+/// Example
+/// -------
+/// ```c
+/// int parse(void *ctx, const void *in, void *out);
+/// int store(void *ctx, const void *in, void *out);
+///
+/// SENDER(const char*) lines_tx;
+/// RECEIVER(const char*) lines_rx;
+/// SENDER(int) numbers_tx;
+/// RECEIVER(int) numbers_rx;
+/// MPSC_CHANNEL(lines_tx, lines_rx);
+/// MPSC_CHANNEL(numbers_tx, numbers_rx);
+/// struct mpsc_pipeline *p = mpsc_pipeline_new(0);
+/// MPSC_PIPELINE_ADD_STAGE(p, parse, NULL, 2, 8, lines_rx, numbers_tx);
+/// MPSC_PIPELINE_ADD_SINK(p, store, NULL, 1, 1, numbers_rx);
+/// mpsc_pipeline_start(p);
+/// // send on `lines_tx`...
+/// MPSC_DROP_SENDER(lines_tx);  // all stages finish
+/// mpsc_pipeline_join(p);
+/// mpsc_pipeline_drop(p);
+/// ```
+#define MPSC_PIPELINE_ADD_STAGE(_p, _fn, _ctx, _threads, _max_threads, _rident, _sident) \
+    ( \
+        mpsc_pipeline_add_stage( \
+            _p, _fn, _ctx, _threads, _max_threads, \
+            (struct mpsc_receiver*)_rident, (struct mpsc_sender*)_sident \
+        ), \
+        _rident = NULL, \
+        _sident = NULL \
+    )
+
+/// Adds the last stage of a pipeline, which has no output.  The function is
+/// called with `NULL` as the output.  See `MPSC_PIPELINE_ADD_STAGE`.
+#define MPSC_PIPELINE_ADD_SINK(_p, _fn, _ctx, _threads, _max_threads, _rident) \
+    ( \
+        mpsc_pipeline_add_stage( \
+            _p, _fn, _ctx, _threads, _max_threads, \
+            (struct mpsc_receiver*)_rident, NULL \
+        ), \
+        _rident = NULL \
+    )
+
 /// Returns a string representation of the error.
 const char* mpsc_error_message(enum mpsc_error err);
 
 struct mpsc_queue* mpsc_queue_new(size_t datasize);
 void mpsc_queue_drop(struct mpsc_queue *queue);
 void mpsc_queue_push(struct mpsc_queue *queue, const void *data);
+void mpsc_queue_push_keyed(struct mpsc_queue *queue, uint64_t key, const void *data);
+void mpsc_queue_push_at(
+    struct mpsc_queue *queue, const void *data, const struct timespec *deadline);
 enum mpsc_error mpsc_queue_pop(struct mpsc_queue *queue, void *data);
+enum mpsc_error mpsc_queue_pop_keyed(struct mpsc_queue *queue, uint64_t *key, void *data);
+void mpsc_queue_push_batch(struct mpsc_queue *queue, const void *data, size_t count);
+size_t mpsc_queue_pop_batch(struct mpsc_queue *queue, void *data, size_t max);
+/// Returns the number of items in the queue, including delayed and spilled ones.
+size_t mpsc_queue_depth(struct mpsc_queue *queue);
 
 struct mpsc_shared_queue mpsc_shared_queue_new(size_t datasize);
+struct mpsc_shared_queue mpsc_shared_queue_new_numa(size_t datasize, int node);
+struct mpsc_shared_queue mpsc_shared_queue_new_keyed(size_t datasize);
+struct mpsc_shared_queue mpsc_shared_queue_new_spill(
+    size_t datasize, size_t threshold, const char *path);
 struct mpsc_queue* mpsc_shared_queue_get(struct mpsc_shared_queue shared_queue);
 struct mpsc_shared_queue mpsc_shared_queue_clone(struct mpsc_shared_queue shared_queue);
 void mpsc_shared_queue_drop(struct mpsc_shared_queue shared_queue);
 
 void mpsc_channel(struct mpsc_sender **tx, struct mpsc_receiver **rx, size_t datasize);
+void mpsc_channel_numa(
+    struct mpsc_sender **tx, struct mpsc_receiver **rx, size_t datasize, int node);
+void mpsc_channel_keyed(
+    struct mpsc_sender **tx, struct mpsc_receiver **rx, size_t datasize);
+void mpsc_channel_spill(
+    struct mpsc_sender **tx, struct mpsc_receiver **rx, size_t datasize,
+    size_t threshold, const char *path);
+
+/// Returns the number of NUMA nodes, 1 if this can't be determined.
+int mpsc_numa_node_count(void);
+/// Returns the NUMA node of the calling thread, 0 if this can't be determined.
+int mpsc_numa_current_node(void);
+/// Pins the calling thread to the CPUs of the given NUMA node.  Returns 0 on
+/// success and -1 on failure.
+int mpsc_numa_pin_thread(int node);
+/// Pins the calling thread to the `cpu`-th CPU the process may run on, modulo
+/// their number, so it works with cpusets and offline CPUs.  Returns 0 on success and -1 on failure.  Like the NUMA functions this is
+/// only supported on Linux with `MPSC_NUMA` defined.
+int mpsc_pin_thread(unsigned cpu);
 
 struct mpsc_receiver* mpsc_receiver_new(struct mpsc_shared_queue queue);
 void mpsc_receiver_drop(struct mpsc_receiver *receiver);
 enum mpsc_error mpsc_receiver_recv(struct mpsc_receiver *receiver, void *data);
+enum mpsc_error mpsc_receiver_recv_keyed(
+    struct mpsc_receiver *receiver, uint64_t *key, void *data);
 enum mpsc_error mpsc_receiver_try_recv(struct mpsc_receiver *receiver, void *data);
 enum mpsc_error mpsc_receiver_recv_timeout(
     struct mpsc_receiver *receiver, void *data, const struct timespec *timeout);
+int mpsc_receiver_numa_pin(struct mpsc_receiver *receiver);
+size_t mpsc_receiver_recv_batch(struct mpsc_receiver *receiver, void *data, size_t max);
 
 struct mpsc_sender* mpsc_sender_new(struct mpsc_shared_queue queue);
 struct mpsc_sender* mpsc_sender_clone(struct mpsc_sender *sender);
 void mpsc_sender_drop(struct mpsc_sender *sender);
 enum mpsc_error mpsc_sender_send(struct mpsc_sender *sender, const void *data);
+enum mpsc_error mpsc_sender_send_keyed(
+    struct mpsc_sender *sender, uint64_t key, const void *data);
+enum mpsc_error mpsc_sender_send_at(
+    struct mpsc_sender *sender, const void *data, const struct timespec *deadline);
+enum mpsc_error mpsc_sender_send_batch(
+    struct mpsc_sender *sender, const void *data, size_t count);
+
+/// Creates an empty pipeline, if `pin` is set every thread is pinned to its
+/// own CPU.  Pinning needs `MPSC_NUMA` on Linux, returns `NULL` if `pin` is set
+/// without it.
+struct mpsc_pipeline* mpsc_pipeline_new(int pin);
+/// Adds a stage that receives items from `input`, calls `fn` on them with
+/// `threads` threads, and sends the results to `output`.  The pipeline takes
+/// ownership of the receiver and sender, once the input channel is closed and
+/// empty all threads of the stage exit and the output is dropped, which
+/// closes the input channel of the next stage.  `max_threads` is the limit
+/// for `mpsc_pipeline_rebalance`.  Returns the index of the stage.
+size_t mpsc_pipeline_add_stage(
+    struct mpsc_pipeline *pipeline, mpsc_stage_fn fn, void *context,
+    size_t threads, size_t max_threads,
+    struct mpsc_receiver *input, struct mpsc_sender *output);
+/// Starts the threads of all stages.  Returns -1 if a thread could not be
+/// created, the stage then runs with fewer threads, and a stage without any
+/// threads is finished right away so the close still reaches the next stage.
+int mpsc_pipeline_start(struct mpsc_pipeline *pipeline);
+/// Waits until all stages have finished.
+void mpsc_pipeline_join(struct mpsc_pipeline *pipeline);
+/// Frees the pipeline, must be joined first if it was started.
+void mpsc_pipeline_drop(struct mpsc_pipeline *pipeline);
+void mpsc_pipeline_stats(
+    struct mpsc_pipeline *pipeline, size_t stage, struct mpsc_stage_stats *stats);
+/// Returns the index of the stage with the most items waiting in its input.
+size_t mpsc_pipeline_bottleneck(struct mpsc_pipeline *pipeline);
+/// Adds a thread to the stage with the most items waiting in its input that is
+/// still below its thread limit.  Meant to be called periodically.  Returns the
+/// index of the stage or -1 if nothing was changed or the thread could not be
+/// created.
+long mpsc_pipeline_rebalance(struct mpsc_pipeline *pipeline);
 #endif
 
 
 
 #ifdef MPSC_IMPLEMENTATION
+#ifdef MPSC__NUMA
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 const char* mpsc_error_message(enum mpsc_error err) {
     switch (err) {
         case mpsc_OK: return "OK";
@@ -241,7 +668,19 @@ static void mpsc_queue_construct(struct mpsc_queue *queue, size_t datasize) {
     queue->head = NULL;
     queue->tail = NULL;
     queue->freelist = NULL;
+    queue->chunks = NULL;
     queue->datasize = datasize;
+    queue->headersize = 0;
+    queue->buckets = NULL;
+    queue->bucket_count = 0;
+    queue->key_count = 0;
+    queue->timers = NULL;
+    queue->timer_count = 0;
+    queue->timer_capacity = 0;
+    queue->timer_seq = 0;
+    queue->length = 0;
+    queue->spill = NULL;
+    queue->numa_node = MPSC_NUMA_NONE;
     mtx_init(&queue->mutex, mtx_plain);
     cnd_init(&queue->cond);
     atomic_init(&queue->senders, 0);
@@ -263,7 +702,82 @@ static void mpsc_free_nodes(struct mpsc_queue_node *node) {
     }
 }
 
+static void mpsc_free_chunks(struct mpsc_queue_chunk *chunk) {
+    struct mpsc_queue_chunk *next;
+    while (chunk) {
+        next = chunk->next;
+#ifdef MPSC__NUMA
+        if (chunk->mapped) {
+            munmap(chunk, chunk->size);
+            chunk = next;
+            continue;
+        }
+#endif
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static void mpsc_spill_close_segments(struct mpsc_spill_segment *segment) {
+    struct mpsc_spill_segment *next;
+    while (segment) {
+        next = segment->next;
+        fclose(segment->file);
+        free(segment);
+        segment = next;
+    }
+}
+
+static void mpsc_spill_free_batches(struct mpsc_spill_batch *batch) {
+    struct mpsc_spill_batch *next;
+    while (batch) {
+        next = batch->next;
+        free(batch);
+        batch = next;
+    }
+}
+
+static void mpsc_queue_destruct_spill(struct mpsc_queue *queue) {
+    struct mpsc_spill *spill = queue->spill;
+    if (spill->has_writer) {
+        mtx_lock(&queue->mutex);
+        spill->stop = 1;
+        cnd_signal(&spill->cond);
+        mtx_unlock(&queue->mutex);
+        thrd_join(spill->writer, NULL);
+    }
+    mpsc_spill_close_segments(spill->segments);
+    mpsc_spill_close_segments(spill->retired);
+    mpsc_spill_free_batches(spill->pending);
+    free(spill->batch);
+    free(spill->path);
+    mtx_destroy(&spill->io);
+    cnd_destroy(&spill->cond);
+    free(spill);
+    queue->spill = NULL;
+}
+
 static void mpsc_queue_destruct(struct mpsc_queue *queue) {
+    if (queue->spill) {
+        mpsc_queue_destruct_spill(queue);
+    }
+    if (queue->chunks) {
+        // All nodes are owned by the chunks.
+        mpsc_free_chunks(queue->chunks);
+        queue->chunks = NULL;
+        queue->head = NULL;
+        queue->tail = NULL;
+        queue->freelist = NULL;
+        queue->timer_count = 0;
+    }
+    if (queue->timer_count) {
+        for (size_t i = 0; i < queue->timer_count; i++) {
+            free(queue->timers[i].node);
+        }
+        queue->timer_count = 0;
+    }
+    free(queue->timers);
+    queue->timers = NULL;
     if (queue->head) {
         mpsc_free_nodes(queue->head);
         queue->head = NULL;
@@ -273,6 +787,8 @@ static void mpsc_queue_destruct(struct mpsc_queue *queue) {
         mpsc_free_nodes(queue->freelist);
         queue->freelist = NULL;
     }
+    free(queue->buckets);
+    queue->buckets = NULL;
     mtx_destroy(&queue->mutex);
     cnd_destroy(&queue->cond);
 }
@@ -282,21 +798,200 @@ void mpsc_queue_drop(struct mpsc_queue *queue) {
     free(queue);
 }
 
+static size_t mpsc_queue_node_size(struct mpsc_queue *queue) {
+    const size_t align = _Alignof(struct mpsc_queue_node);
+    const size_t size
+        = sizeof(struct mpsc_queue_node) + queue->headersize + queue->datasize;
+    return (size + align - 1) / align * align;
+}
+
+#ifdef MPSC__NUMA
+/// Bit mask of CPUs or NUMA nodes as used by the kernel, we use our own instead
+/// of `cpu_set_t` and libnuma's types so we only need `syscall`.
+struct mpsc_numa_mask {
+    unsigned long bits[1024 / (8 * sizeof(unsigned long))];
+};
+
+enum { MPSC__MASK_BITS = 8 * sizeof(struct mpsc_numa_mask) };
+
+static void mpsc_numa_mask_set(int n, void *arg) {
+    struct mpsc_numa_mask *mask = (struct mpsc_numa_mask*)arg;
+    const int long_bits = 8 * sizeof(unsigned long);
+    if (n >= 0 && n < MPSC__MASK_BITS) {
+        mask->bits[n / long_bits] |= 1UL << (n % long_bits);
+    }
+}
+
+static int mpsc_numa_bind(void *addr, size_t size, int node) {
+    enum { MPOL_PREFERRED_ = 1 };
+    struct mpsc_numa_mask mask = {{0}};
+    if (node < 0 || node >= MPSC__MASK_BITS) {
+        return -1;
+    }
+    mpsc_numa_mask_set(node, &mask);
+    return (int)syscall(
+        SYS_mbind, addr, size, MPOL_PREFERRED_, mask.bits,
+        (unsigned long)MPSC__MASK_BITS + 1, 0
+    );
+}
+
+/// CPUs the first caller of `mpsc_pin_thread` was allowed to run on, read
+/// once so pinned threads don't narrow it down for the next ones.
+static struct mpsc_numa_mask mpsc_allowed_cpus;
+static int mpsc_allowed_cpu_count;
+static once_flag mpsc_allowed_cpus_once = ONCE_FLAG_INIT;
+
+static void mpsc_read_allowed_cpus(void) {
+    const int long_bits = 8 * sizeof(unsigned long);
+    if (syscall(
+            SYS_sched_getaffinity, 0, sizeof(mpsc_allowed_cpus.bits),
+            mpsc_allowed_cpus.bits
+        ) < 0) {
+        return;
+    }
+    for (int n = 0; n < MPSC__MASK_BITS; n++) {
+        if (mpsc_allowed_cpus.bits[n / long_bits] & (1UL << (n % long_bits))) {
+            ++mpsc_allowed_cpu_count;
+        }
+    }
+}
+
+static int mpsc_set_affinity(const struct mpsc_numa_mask *mask) {
+    return syscall(SYS_sched_setaffinity, 0, sizeof(mask->bits), mask->bits) == 0
+        ? 0
+        : -1;
+}
+#endif
+
+/// Allocates a chunk of nodes on the queues NUMA node and puts them on the
+/// freelist.  The nodes are written here after the memory was bound so they
+/// are faulted in on the right node even if we're on a different one.
+static void mpsc_queue_grow_chunk(struct mpsc_queue *queue) {
+    const size_t node_size = mpsc_queue_node_size(queue);
+    const size_t align = _Alignof(struct mpsc_queue_node);
+    const size_t header
+        = (sizeof(struct mpsc_queue_chunk) + align - 1) / align * align;
+    size_t size = header + node_size * MPSC_NUMA_CHUNK_NODES;
+    struct mpsc_queue_chunk *chunk = NULL;
+#ifdef MPSC__NUMA
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+    void *mem = mmap(
+        NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    if (mem != MAP_FAILED) {
+        // If binding fails we still get first-touch placement from whoever
+        // grows the queue, which is no worse than malloc.
+        (void)mpsc_numa_bind(mem, size, queue->numa_node);
+        chunk = (struct mpsc_queue_chunk*)mem;
+        chunk->mapped = 1;
+    }
+#endif
+    if (!chunk) {
+        chunk = (struct mpsc_queue_chunk*)malloc(size);
+        chunk->mapped = 0;
+    }
+    chunk->size = size;
+    chunk->next = queue->chunks;
+    queue->chunks = chunk;
+    char *p = (char*)chunk + header;
+    for (; p + node_size <= (char*)chunk + size; p += node_size) {
+        struct mpsc_queue_node *node = (struct mpsc_queue_node*)p;
+        node->next = queue->freelist;
+        queue->freelist = node;
+    }
+}
+
 static struct mpsc_queue_node* mpsc_queue_new_node(struct mpsc_queue *queue) {
     struct mpsc_queue_node *node;
+    if (!queue->freelist && queue->numa_node != MPSC_NUMA_NONE) {
+        mpsc_queue_grow_chunk(queue);
+    }
     if (queue->freelist) {
         node = queue->freelist;
         queue->freelist = node->next;
     } else {
-        node = (struct mpsc_queue_node*)malloc(sizeof(*node) + queue->datasize);
+        node = (struct mpsc_queue_node*)malloc(
+            sizeof(*node) + queue->headersize + queue->datasize
+        );
     }
     return node;
 }
 
-void mpsc_queue_push(struct mpsc_queue *queue, const void *data) {
-    mtx_lock(&queue->mutex);
-    struct mpsc_queue_node *node = mpsc_queue_new_node(queue);
-    memcpy(node->data, data, queue->datasize);
+static void* mpsc_queue_node_data(
+    struct mpsc_queue *queue, struct mpsc_queue_node *node
+) {
+    return node->data + queue->headersize;
+}
+
+static struct mpsc_queue_key* mpsc_queue_node_key(struct mpsc_queue_node *node) {
+    return (struct mpsc_queue_key*)node->data;
+}
+
+static size_t mpsc_queue_bucket(struct mpsc_queue *queue, uint64_t key) {
+    // Fibonacci hashing, bucket_count is always a power of two.
+    return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32)
+        & (queue->bucket_count - 1);
+}
+
+static struct mpsc_queue_node* mpsc_queue_find_key(
+    struct mpsc_queue *queue, uint64_t key
+) {
+    if (!queue->bucket_count) {
+        return NULL;
+    }
+    struct mpsc_queue_node *node = queue->buckets[mpsc_queue_bucket(queue, key)];
+    while (node && mpsc_queue_node_key(node)->key != key) {
+        node = mpsc_queue_node_key(node)->chain;
+    }
+    return node;
+}
+
+static void mpsc_queue_insert_key(
+    struct mpsc_queue *queue, struct mpsc_queue_node *node
+) {
+    if (queue->key_count >= queue->bucket_count) {
+        const size_t old_count = queue->bucket_count;
+        struct mpsc_queue_node **old = queue->buckets;
+        queue->bucket_count = old_count ? old_count * 2 : 16;
+        queue->buckets = (struct mpsc_queue_node**)calloc(
+            queue->bucket_count, sizeof(*queue->buckets)
+        );
+        for (size_t i = 0; i < old_count; i++) {
+            struct mpsc_queue_node *n = old[i], *next;
+            for (; n; n = next) {
+                struct mpsc_queue_key *k = mpsc_queue_node_key(n);
+                next = k->chain;
+                const size_t bucket = mpsc_queue_bucket(queue, k->key);
+                k->chain = queue->buckets[bucket];
+                queue->buckets[bucket] = n;
+            }
+        }
+        free(old);
+    }
+    struct mpsc_queue_key *k = mpsc_queue_node_key(node);
+    const size_t bucket = mpsc_queue_bucket(queue, k->key);
+    k->chain = queue->buckets[bucket];
+    queue->buckets[bucket] = node;
+    ++queue->key_count;
+}
+
+static void mpsc_queue_remove_key(
+    struct mpsc_queue *queue, struct mpsc_queue_node *node
+) {
+    struct mpsc_queue_key *k = mpsc_queue_node_key(node);
+    struct mpsc_queue_node **link
+        = &queue->buckets[mpsc_queue_bucket(queue, k->key)];
+    while (*link != node) {
+        link = &mpsc_queue_node_key(*link)->chain;
+    }
+    *link = k->chain;
+    --queue->key_count;
+}
+
+static void mpsc_queue_link_locked(
+    struct mpsc_queue *queue, struct mpsc_queue_node *node
+) {
     node->next = NULL;
     if (queue->tail) {
         queue->tail->next = node;
@@ -304,40 +999,548 @@ void mpsc_queue_push(struct mpsc_queue *queue, const void *data) {
         queue->head = node;
     }
     queue->tail = node;
+    ++queue->length;
+}
+
+/// Number of spilled records that were not received yet.
+static size_t mpsc_queue_spilled(struct mpsc_queue *queue) {
+    return queue->spill ? queue->spill->count : 0;
+}
+
+#if defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L
+static int mpsc_spill_seek(FILE *file, size_t offset) {
+    return fseeko(file, (off_t)offset, SEEK_SET);
+}
+#else
+static int mpsc_spill_seek(FILE *file, size_t offset) {
+    // Only used without POSIX, segment sizes are limited to fit into a long
+    // in `mpsc_shared_queue_new_spill`.
+    return fseek(file, (long)offset, SEEK_SET);
+}
+#endif
+
+/// Opens a new segment file, only called by the writer thread.
+static struct mpsc_spill_segment* mpsc_spill_segment_open(struct mpsc_spill *spill) {
+    FILE *file;
+    if (spill->path) {
+        const size_t size = strlen(spill->path) + 16;
+        char *name = (char*)malloc(size);
+        snprintf(name, size, "%s.%u", spill->path, spill->next_file++);
+        file = fopen(name, "w+b");
+        if (file) {
+            // Gets deleted once closed.
+            remove(name);
+        }
+        free(name);
+    } else {
+        file = tmpfile();
+    }
+    if (!file) {
+        return NULL;
+    }
+    struct mpsc_spill_segment *segment
+        = (struct mpsc_spill_segment*)malloc(sizeof(*segment));
+    segment->file = file;
+    return segment;
+}
+
+/// Writes full batches to the segment files.  Keeps one fully read segment
+/// around to reuse it instead of creating a new file every time.
+static int mpsc_spill_writer(void *arg) {
+    struct mpsc_queue *queue = (struct mpsc_queue*)arg;
+    struct mpsc_spill *spill = queue->spill;
+    struct mpsc_spill_segment *spare = NULL;
+    mtx_lock(&queue->mutex);
+    for (;;) {
+        while (!spill->stop && !spill->retired && !(spill->pending && !spill->failed)) {
+            cnd_wait(&spill->cond, &queue->mutex);
+        }
+        if (spill->retired) {
+            struct mpsc_spill_segment *retired = spill->retired;
+            spill->retired = NULL;
+            mtx_unlock(&queue->mutex);
+            if (!spare) {
+                spare = retired;
+                retired = retired->next;
+                spare->next = NULL;
+            }
+            mpsc_spill_close_segments(retired);
+            mtx_lock(&queue->mutex);
+            continue;
+        }
+        if (spill->stop) {
+            break;
+        }
+        struct mpsc_spill_batch *batch = spill->pending;
+        struct mpsc_spill_segment *segment = spill->segments_tail;
+        const int new_segment
+            = !segment || segment->written == spill->segment_records;
+        spill->writing = 1;
+        mtx_unlock(&queue->mutex);
+        if (new_segment) {
+            if (spare) {
+                segment = spare;
+                spare = NULL;
+            } else {
+                segment = mpsc_spill_segment_open(spill);
+            }
+            if (segment) {
+                segment->next = NULL;
+                segment->written = 0;
+                segment->read = 0;
+            }
+        }
+        int ok = segment != NULL;
+        if (ok) {
+            // `written` is only changed by us so it's fine to read it here.
+            mtx_lock(&spill->io);
+            ok = mpsc_spill_seek(segment->file, segment->written * queue->datasize) == 0
+                && fwrite(batch->data, queue->datasize, batch->count, segment->file)
+                    == batch->count
+                && fflush(segment->file) == 0;
+            mtx_unlock(&spill->io);
+        }
+        mtx_lock(&queue->mutex);
+        spill->writing = 0;
+        if (new_segment && segment) {
+            if (spill->segments_tail) {
+                spill->segments_tail->next = segment;
+            } else {
+                spill->segments = segment;
+            }
+            spill->segments_tail = segment;
+        }
+        if (ok) {
+            segment->written += batch->count;
+            spill->pending = batch->next;
+            if (!spill->pending) {
+                spill->pending_tail = NULL;
+            }
+            free(batch);
+        } else {
+            spill->failed = 1;
+            fprintf(stderr, "mpsc: warning: could not write spill file, keeping data in memory\n");
+        }
+        // The receiver may be waiting for the batch to be written.
+        cnd_broadcast(&queue->cond);
+    }
     mtx_unlock(&queue->mutex);
-    cnd_signal(&queue->cond);
+    mpsc_spill_close_segments(spare);
+    return 0;
 }
 
-static int mpsc_queue_closed(struct mpsc_queue *queue) {
-    return queue->senders == 0 || queue->receivers == 0;
+/// Moves the data of the node into the current spill batch and hands the batch
+/// to the writer once it is full.
+static void mpsc_queue_spill_node(
+    struct mpsc_queue *queue, struct mpsc_queue_node *node
+) {
+    struct mpsc_spill *spill = queue->spill;
+    if (!spill->batch) {
+        spill->batch = (struct mpsc_spill_batch*)malloc(
+            sizeof(*spill->batch) + MPSC_SPILL_BATCH * queue->datasize
+        );
+        spill->batch->next = NULL;
+        spill->batch->count = 0;
+    }
+    struct mpsc_spill_batch *batch = spill->batch;
+    memcpy(
+        batch->data + batch->count * queue->datasize,
+        mpsc_queue_node_data(queue, node),
+        queue->datasize
+    );
+    ++batch->count;
+    ++spill->count;
+    node->next = queue->freelist;
+    queue->freelist = node;
+    if (batch->count == MPSC_SPILL_BATCH) {
+        if (spill->pending_tail) {
+            spill->pending_tail->next = batch;
+        } else {
+            spill->pending = batch;
+        }
+        spill->pending_tail = batch;
+        spill->batch = NULL;
+        cnd_signal(&spill->cond);
+    }
 }
 
-static int mpsc_queue_closed_and_empty(struct mpsc_queue *queue) {
-    return mpsc_queue_closed(queue) && !queue->head;
+/// Appends the node to the queue, or to the spill file if the queue is too
+/// long or there already is spilled data that needs to be received first.
+static void mpsc_queue_append_locked(
+    struct mpsc_queue *queue, struct mpsc_queue_node *node
+) {
+    if (queue->spill
+        && (queue->length >= queue->spill->threshold || queue->spill->count)) {
+        mpsc_queue_spill_node(queue, node);
+    } else {
+        mpsc_queue_link_locked(queue, node);
+    }
 }
 
-enum mpsc_error mpsc_queue_pop(struct mpsc_queue *queue, void *data) {
+/// Links `count` records from `data` into the queue.
+static void mpsc_queue_link_records(
+    struct mpsc_queue *queue, const char *data, size_t count
+) {
+    for (size_t i = 0; i < count; i++) {
+        struct mpsc_queue_node *node = mpsc_queue_new_node(queue);
+        memcpy(
+            mpsc_queue_node_data(queue, node),
+            data + i * queue->datasize,
+            queue->datasize
+        );
+        mpsc_queue_link_locked(queue, node);
+    }
+}
+
+/// Reads up to `MPSC_SPILL_BATCH` records from the first segment into the
+/// queue.  The queue is unlocked while reading the file.
+static void mpsc_queue_read_segment(
+    struct mpsc_queue *queue, struct mpsc_spill_segment *segment
+) {
+    struct mpsc_spill *spill = queue->spill;
+    size_t count = segment->written - segment->read;
+    if (count > MPSC_SPILL_BATCH) {
+        count = MPSC_SPILL_BATCH;
+    }
+    const size_t offset = segment->read * queue->datasize;
+    char *buffer = (char*)malloc(count * queue->datasize);
+    // Nobody else touches the first segment while `reading` is set.
+    spill->reading = 1;
+    mtx_unlock(&queue->mutex);
+    size_t got = 0;
+    mtx_lock(&spill->io);
+    if (mpsc_spill_seek(segment->file, offset) == 0) {
+        got = fread(buffer, queue->datasize, count, segment->file);
+    }
+    mtx_unlock(&spill->io);
     mtx_lock(&queue->mutex);
-    while (!queue->head && !mpsc_queue_closed(queue)) {
-        cnd_wait(&queue->cond, &queue->mutex);
+    spill->reading = 0;
+    if (got < count) {
+        fprintf(stderr, "mpsc: error: could not read spilled data, it is lost\n");
     }
-    if (mpsc_queue_closed_and_empty(queue)) {
-        mtx_unlock(&queue->mutex);
-        return mpsc_CLOSED;
+    mpsc_queue_link_records(queue, buffer, got);
+    free(buffer);
+    segment->read += count;
+    spill->count -= count;
+    if (segment->read == spill->segment_records) {
+        // Only full segments are retired, the writer is done with them.
+        spill->segments = segment->next;
+        if (!spill->segments) {
+            spill->segments_tail = NULL;
+        }
+        segment->next = spill->retired;
+        spill->retired = segment;
+        cnd_signal(&spill->cond);
     }
+    // Other receivers may have been waiting for us.
+    cnd_broadcast(&queue->cond);
+}
+
+/// Moves up to `MPSC_SPILL_BATCH` spilled records back into the queue, oldest
+/// first.  Only done once the in-memory part is drained to keep the order.
+/// Spilled data is first in the segments, then in the pending batches, and
+/// then in the current batch.
+static void mpsc_queue_unspill(struct mpsc_queue *queue) {
+    struct mpsc_spill *spill = queue->spill;
+    if (!spill || queue->head || !spill->count || spill->reading) {
+        return;
+    }
+    struct mpsc_spill_segment *segment = spill->segments;
+    struct mpsc_spill_batch *batch;
+    if (segment && segment->read < segment->written) {
+        mpsc_queue_read_segment(queue, segment);
+    } else if (spill->pending) {
+        if (spill->writing) {
+            // It is in the segment once the writer is done.
+            return;
+        }
+        batch = spill->pending;
+        spill->pending = batch->next;
+        if (!spill->pending) {
+            spill->pending_tail = NULL;
+        }
+        mpsc_queue_link_records(queue, batch->data, batch->count);
+        spill->count -= batch->count;
+        free(batch);
+    } else if (spill->batch) {
+        batch = spill->batch;
+        spill->batch = NULL;
+        mpsc_queue_link_records(queue, batch->data, batch->count);
+        spill->count -= batch->count;
+        free(batch);
+    }
+}
+
+static int mpsc_timespec_cmp(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec) {
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    }
+    if (a->tv_nsec != b->tv_nsec) {
+        return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+static int mpsc_timer_less(
+    const struct mpsc_queue_timer *a, const struct mpsc_queue_timer *b
+) {
+    const int cmp = mpsc_timespec_cmp(&a->deadline, &b->deadline);
+    return cmp ? cmp < 0 : a->seq < b->seq;
+}
+
+static void mpsc_queue_timer_push(
+    struct mpsc_queue *queue, struct mpsc_queue_node *node,
+    const struct timespec *deadline
+) {
+    if (queue->timer_count == queue->timer_capacity) {
+        queue->timer_capacity = queue->timer_capacity ? queue->timer_capacity * 2 : 16;
+        queue->timers = (struct mpsc_queue_timer*)realloc(
+            queue->timers, queue->timer_capacity * sizeof(*queue->timers)
+        );
+    }
+    struct mpsc_queue_timer timer = {*deadline, queue->timer_seq++, node};
+    size_t i = queue->timer_count++;
+    while (i > 0) {
+        const size_t parent = (i - 1) / 2;
+        if (!mpsc_timer_less(&timer, &queue->timers[parent])) {
+            break;
+        }
+        queue->timers[i] = queue->timers[parent];
+        i = parent;
+    }
+    queue->timers[i] = timer;
+}
+
+static struct mpsc_queue_node* mpsc_queue_timer_pop(struct mpsc_queue *queue) {
+    struct mpsc_queue_node *node = queue->timers[0].node;
+    const struct mpsc_queue_timer last = queue->timers[--queue->timer_count];
+    const size_t count = queue->timer_count;
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count
+            && mpsc_timer_less(&queue->timers[child + 1], &queue->timers[child])) {
+            ++child;
+        }
+        if (!mpsc_timer_less(&queue->timers[child], &last)) {
+            break;
+        }
+        queue->timers[i] = queue->timers[child];
+        i = child;
+    }
+    if (count) {
+        queue->timers[i] = last;
+    }
+    return node;
+}
+
+/// Moves all nodes whose deadline has passed from the timer heap to the end of
+/// the queue.  The queue must be locked.
+static void mpsc_queue_promote_due(struct mpsc_queue *queue) {
+    if (!queue->timer_count) {
+        return;
+    }
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    while (queue->timer_count
+           && mpsc_timespec_cmp(&queue->timers[0].deadline, &now) <= 0) {
+        mpsc_queue_append_locked(queue, mpsc_queue_timer_pop(queue));
+    }
+}
+
+/// Appends the data to the queue, or overwrites the pending data with the same
+/// key if `hashed` is set.  The queue must be locked.
+static void mpsc_queue_push_locked(
+    struct mpsc_queue *queue, uint64_t key, int hashed, const void *data
+) {
+    struct mpsc_queue_node *node;
+    if (hashed && (node = mpsc_queue_find_key(queue, key))) {
+        memcpy(mpsc_queue_node_data(queue, node), data, queue->datasize);
+        return;
+    }
+    node = mpsc_queue_new_node(queue);
+    memcpy(mpsc_queue_node_data(queue, node), data, queue->datasize);
+    if (queue->headersize) {
+        struct mpsc_queue_key *k = mpsc_queue_node_key(node);
+        k->key = hashed ? key : 0;
+        k->hashed = hashed;
+        if (hashed) {
+            mpsc_queue_insert_key(queue, node);
+        }
+    }
+    mpsc_queue_append_locked(queue, node);
+}
+
+void mpsc_queue_push(struct mpsc_queue *queue, const void *data) {
+    mtx_lock(&queue->mutex);
+    mpsc_queue_push_locked(queue, 0, 0, data);
+    mtx_unlock(&queue->mutex);
+    cnd_signal(&queue->cond);
+}
+
+void mpsc_queue_push_at(
+    struct mpsc_queue *queue, const void *data, const struct timespec *deadline
+) {
+    mtx_lock(&queue->mutex);
+    struct mpsc_queue_node *node = mpsc_queue_new_node(queue);
+    memcpy(mpsc_queue_node_data(queue, node), data, queue->datasize);
+    if (queue->headersize) {
+        mpsc_queue_node_key(node)->key = 0;
+        mpsc_queue_node_key(node)->hashed = 0;
+    }
+    mpsc_queue_timer_push(queue, node, deadline);
+    mtx_unlock(&queue->mutex);
+    // Always wake the receiver since it may need to wait for a shorter time now.
+    cnd_signal(&queue->cond);
+}
+
+void mpsc_queue_push_keyed(struct mpsc_queue *queue, uint64_t key, const void *data) {
+    mtx_lock(&queue->mutex);
+    mpsc_queue_push_locked(queue, key, queue->headersize != 0, data);
+    mtx_unlock(&queue->mutex);
+    cnd_signal(&queue->cond);
+}
+
+/// Removes the head of the queue, which must exist, and copies out its data.
+/// The queue must be locked.
+static void mpsc_queue_pop_locked(
+    struct mpsc_queue *queue, uint64_t *key, void *data
+) {
     struct mpsc_queue_node *node = queue->head;
     queue->head = node->next;
     if (!queue->head) {
         queue->tail = NULL;
     }
-    memcpy(data, node->data, queue->datasize);
+    --queue->length;
+    if (queue->headersize && mpsc_queue_node_key(node)->hashed) {
+        mpsc_queue_remove_key(queue, node);
+    }
+    if (key) {
+        *key = queue->headersize ? mpsc_queue_node_key(node)->key : 0;
+    }
+    memcpy(data, mpsc_queue_node_data(queue, node), queue->datasize);
     node->next = queue->freelist;
     queue->freelist = node;
+}
+
+static int mpsc_queue_closed(struct mpsc_queue *queue) {
+    return queue->senders == 0 || queue->receivers == 0;
+}
+
+static int mpsc_queue_closed_and_empty(struct mpsc_queue *queue) {
+    return mpsc_queue_closed(queue) && !queue->head && !queue->timer_count
+        && !mpsc_queue_spilled(queue);
+}
+
+/// Moves due timers and spilled data into the queue.  The queue must be locked.
+static void mpsc_queue_fill_locked(struct mpsc_queue *queue) {
+    mpsc_queue_promote_due(queue);
+    mpsc_queue_unspill(queue);
+}
+
+/// Waits until the queue has data, is closed, or the timeout is reached, in
+/// which case `mpsc_TIMEOUT` is returned.  A `NULL` timeout waits forever.
+/// While waiting the receiver wakes up for the earliest deadline in the timer
+/// heap.  The queue must be locked.
+static enum mpsc_error mpsc_queue_wait_locked(
+    struct mpsc_queue *queue, const struct timespec *timeout
+) {
+    for (;;) {
+        mpsc_queue_fill_locked(queue);
+        if (queue->head) {
+            return mpsc_OK;
+        }
+        // Spilled data may still be written or read by someone else, it
+        // arrives with a broadcast on `cond` like timers do.
+        if (mpsc_queue_closed(queue)
+            && ((!queue->timer_count && !mpsc_queue_spilled(queue))
+                || queue->receivers == 0)) {
+            return mpsc_CLOSED;
+        }
+        struct timespec until;
+        int is_timeout = 0;
+        if (timeout) {
+            until = *timeout;
+            is_timeout = 1;
+        }
+        if (queue->timer_count
+            && (!timeout || mpsc_timespec_cmp(&queue->timers[0].deadline, timeout) <= 0)) {
+            until = queue->timers[0].deadline;
+            is_timeout = 0;
+        }
+        if (timeout || queue->timer_count) {
+            if (cnd_timedwait(&queue->cond, &queue->mutex, &until) == thrd_timedout
+                && is_timeout) {
+                // Data may have become due at the same time.
+                mpsc_queue_fill_locked(queue);
+                return queue->head ? mpsc_OK : mpsc_TIMEOUT;
+            }
+        } else {
+            cnd_wait(&queue->cond, &queue->mutex);
+        }
+    }
+}
+
+enum mpsc_error mpsc_queue_pop_keyed(struct mpsc_queue *queue, uint64_t *key, void *data) {
+    mtx_lock(&queue->mutex);
+    if (mpsc_queue_wait_locked(queue, NULL) == mpsc_CLOSED) {
+        mtx_unlock(&queue->mutex);
+        return mpsc_CLOSED;
+    }
+    mpsc_queue_pop_locked(queue, key, data);
     mtx_unlock(&queue->mutex);
     cnd_signal(&queue->cond);
     return mpsc_OK;
 }
 
+enum mpsc_error mpsc_queue_pop(struct mpsc_queue *queue, void *data) {
+    return mpsc_queue_pop_keyed(queue, NULL, data);
+}
+
+void mpsc_queue_push_batch(struct mpsc_queue *queue, const void *data, size_t count) {
+    mtx_lock(&queue->mutex);
+    for (size_t i = 0; i < count; i++) {
+        mpsc_queue_push_locked(
+            queue, 0, 0, (const char*)data + i * queue->datasize
+        );
+    }
+    mtx_unlock(&queue->mutex);
+    cnd_broadcast(&queue->cond);
+}
+
+/// Waits for data and then receives up to `max` items with a single lock.
+/// Returns 0 if the queue is closed.
+size_t mpsc_queue_pop_batch(struct mpsc_queue *queue, void *data, size_t max) {
+    size_t count = 0;
+    mtx_lock(&queue->mutex);
+    if (mpsc_queue_wait_locked(queue, NULL) == mpsc_CLOSED) {
+        mtx_unlock(&queue->mutex);
+        return 0;
+    }
+    while (count < max) {
+        if (!queue->head) {
+            mpsc_queue_fill_locked(queue);
+            if (!queue->head) {
+                break;
+            }
+        }
+        mpsc_queue_pop_locked(queue, NULL, (char*)data + count * queue->datasize);
+        ++count;
+    }
+    mtx_unlock(&queue->mutex);
+    return count;
+}
+
+size_t mpsc_queue_depth(struct mpsc_queue *queue) {
+    mtx_lock(&queue->mutex);
+    const size_t depth = queue->length + queue->timer_count + mpsc_queue_spilled(queue);
+    mtx_unlock(&queue->mutex);
+    return depth;
+}
+
 struct mpsc_shared_queue mpsc_shared_queue_new(size_t datasize) {
     struct mpsc_shared_queue shared_queue;
     shared_queue.inner
@@ -347,6 +1550,60 @@ struct mpsc_shared_queue mpsc_shared_queue_new(size_t datasize) {
     return shared_queue;
 }
 
+struct mpsc_shared_queue mpsc_shared_queue_new_numa(size_t datasize, int node) {
+    struct mpsc_shared_queue shared_queue = mpsc_shared_queue_new(datasize);
+    if (node == MPSC_NUMA_LOCAL) {
+        node = mpsc_numa_current_node();
+    }
+    // On single node systems there's nothing to gain, keep using malloc.
+    const int count = mpsc_numa_node_count();
+    if (count > 1 && node >= 0 && node < count) {
+        shared_queue.inner->queue.numa_node = node;
+    }
+    return shared_queue;
+}
+
+struct mpsc_shared_queue mpsc_shared_queue_new_keyed(size_t datasize) {
+    struct mpsc_shared_queue shared_queue = mpsc_shared_queue_new(datasize);
+    const size_t align = _Alignof(struct mpsc_queue_key);
+    shared_queue.inner->queue.headersize
+        = (sizeof(struct mpsc_queue_key) + align - 1) / align * align;
+    return shared_queue;
+}
+
+struct mpsc_shared_queue mpsc_shared_queue_new_spill(
+    size_t datasize, size_t threshold, const char *path
+) {
+    struct mpsc_shared_queue shared_queue = mpsc_shared_queue_new(datasize);
+    struct mpsc_queue *q = &shared_queue.inner->queue;
+    struct mpsc_spill *spill = (struct mpsc_spill*)calloc(1, sizeof(*spill));
+    spill->threshold = threshold;
+    const size_t batch_size = (datasize ? datasize : 1) * MPSC_SPILL_BATCH;
+    size_t batches = MPSC_SPILL_SEGMENT_SIZE / batch_size;
+#if !(defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L)
+    // Offsets must fit into a long for `fseek`.
+    if (batches > (size_t)LONG_MAX / batch_size) {
+        batches = (size_t)LONG_MAX / batch_size;
+    }
+#endif
+    spill->segment_records = (batches ? batches : 1) * MPSC_SPILL_BATCH;
+    if (path) {
+        const size_t len = strlen(path) + 1;
+        spill->path = (char*)malloc(len);
+        memcpy(spill->path, path, len);
+    }
+    mtx_init(&spill->io, mtx_plain);
+    cnd_init(&spill->cond);
+    q->spill = spill;
+    if (thrd_create(&spill->writer, mpsc_spill_writer, q) == thrd_success) {
+        spill->has_writer = 1;
+    } else {
+        fprintf(stderr, "mpsc: warning: could not start spill writer, keeping data in memory\n");
+        spill->failed = 1;
+    }
+    return shared_queue;
+}
+
 struct mpsc_queue* mpsc_shared_queue_get(struct mpsc_shared_queue shared_queue) {
     return &shared_queue.inner->queue;
 }
@@ -369,6 +1626,131 @@ void mpsc_channel(struct mpsc_sender **tx, struct mpsc_receiver **rx, size_t dat
     *tx = mpsc_sender_new(queue);
 }
 
+void mpsc_channel_numa(
+    struct mpsc_sender **tx, struct mpsc_receiver **rx, size_t datasize, int node
+) {
+    struct mpsc_shared_queue queue = mpsc_shared_queue_new_numa(datasize, node);
+    *rx = mpsc_receiver_new(mpsc_shared_queue_clone(queue));
+    *tx = mpsc_sender_new(queue);
+}
+
+void mpsc_channel_keyed(
+    struct mpsc_sender **tx, struct mpsc_receiver **rx, size_t datasize
+) {
+    struct mpsc_shared_queue queue = mpsc_shared_queue_new_keyed(datasize);
+    *rx = mpsc_receiver_new(mpsc_shared_queue_clone(queue));
+    *tx = mpsc_sender_new(queue);
+}
+
+void mpsc_channel_spill(
+    struct mpsc_sender **tx, struct mpsc_receiver **rx, size_t datasize,
+    size_t threshold, const char *path
+) {
+    struct mpsc_shared_queue queue
+        = mpsc_shared_queue_new_spill(datasize, threshold, path);
+    *rx = mpsc_receiver_new(mpsc_shared_queue_clone(queue));
+    *tx = mpsc_sender_new(queue);
+}
+
+#ifdef MPSC__NUMA
+/// Reads a node list like "0-3,8,10-11" from the given sysfs file, calling
+/// `fn` for every number in it.  Returns the number of ranges read.
+static int mpsc_numa_read_list(
+    const char *path, void (*fn)(int, void*), void *arg
+) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    int count = 0;
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &last) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (int i = first; i <= last; i++) {
+            fn(i, arg);
+        }
+        ++count;
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+static void mpsc_numa_max(int n, void *arg) {
+    if (n > *(int*)arg) {
+        *(int*)arg = n;
+    }
+}
+#endif
+
+int mpsc_numa_node_count(void) {
+#ifdef MPSC__NUMA
+    int max = 0;
+    mpsc_numa_read_list("/sys/devices/system/node/online", mpsc_numa_max, &max);
+    return max + 1;
+#else
+    return 1;
+#endif
+}
+
+int mpsc_numa_current_node(void) {
+#ifdef MPSC__NUMA
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return (int)node;
+    }
+#endif
+    return 0;
+}
+
+int mpsc_numa_pin_thread(int node) {
+#ifdef MPSC__NUMA
+    char path[64];
+    struct mpsc_numa_mask mask = {{0}};
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (node < 0 || !mpsc_numa_read_list(path, mpsc_numa_mask_set, &mask)) {
+        return -1;
+    }
+    return mpsc_set_affinity(&mask);
+#else
+    (void)node;
+    return -1;
+#endif
+}
+
+int mpsc_pin_thread(unsigned cpu) {
+#ifdef MPSC__NUMA
+    const int long_bits = 8 * sizeof(unsigned long);
+    struct mpsc_numa_mask mask = {{0}};
+    call_once(&mpsc_allowed_cpus_once, mpsc_read_allowed_cpus);
+    if (mpsc_allowed_cpu_count == 0) {
+        return -1;
+    }
+    // The allowed CPUs don't need to be numbered 0 to n-1, find the n-th one.
+    unsigned skip = cpu % (unsigned)mpsc_allowed_cpu_count;
+    for (int n = 0; n < MPSC__MASK_BITS; n++) {
+        if (mpsc_allowed_cpus.bits[n / long_bits] & (1UL << (n % long_bits))
+            && skip-- == 0) {
+            mpsc_numa_mask_set(n, &mask);
+            break;
+        }
+    }
+    return mpsc_set_affinity(&mask);
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
 struct mpsc_receiver* mpsc_receiver_new(struct mpsc_shared_queue queue) {
     struct mpsc_receiver *r = (struct mpsc_receiver*)malloc(sizeof(*r));
     r->queue = queue;
@@ -381,7 +1763,7 @@ struct mpsc_receiver* mpsc_receiver_new(struct mpsc_shared_queue queue) {
 void mpsc_receiver_drop(struct mpsc_receiver *receiver) {
     struct mpsc_queue *queue = mpsc_shared_queue_get(receiver->queue);
     if (atomic_fetch_sub(&queue->receivers, 1) == 1) {
-        cnd_signal(&queue->cond);
+        cnd_broadcast(&queue->cond);
     }
     mpsc_shared_queue_drop(receiver->queue);
     memset(receiver, 0, sizeof(*receiver));
@@ -394,18 +1776,29 @@ enum mpsc_error mpsc_receiver_recv(struct mpsc_receiver *receiver, void *data) {
     return mpsc_queue_pop(q, data);
 }
 
+enum mpsc_error mpsc_receiver_recv_keyed(
+    struct mpsc_receiver *receiver, uint64_t *key, void *data
+) {
+    struct mpsc_queue *q = mpsc_shared_queue_get(receiver->queue);
+    if (mpsc_queue_closed_and_empty(q)) { return mpsc_CLOSED; }
+    return mpsc_queue_pop_keyed(q, key, data);
+}
+
 enum mpsc_error mpsc_receiver_try_recv(
     struct mpsc_receiver *receiver, void *data
 ) {
     struct mpsc_queue *q = mpsc_shared_queue_get(receiver->queue);
     if (mpsc_queue_closed_and_empty(q)) { return mpsc_CLOSED; }
     mtx_lock(&q->mutex);
+    mpsc_queue_fill_locked(q);
     if (!q->head) {
         mtx_unlock(&q->mutex);
         return mpsc_EMPTY;
     }
+    mpsc_queue_pop_locked(q, NULL, data);
     mtx_unlock(&q->mutex);
-    return mpsc_queue_pop(q, data);
+    cnd_signal(&q->cond);
+    return mpsc_OK;
 }
 
 enum mpsc_error mpsc_receiver_recv_timeout(
@@ -414,14 +1807,27 @@ enum mpsc_error mpsc_receiver_recv_timeout(
     struct mpsc_queue *q = mpsc_shared_queue_get(receiver->queue);
     if (mpsc_queue_closed_and_empty(q)) { return mpsc_CLOSED; }
     mtx_lock(&q->mutex);
-    while (!q->head) {
-        if (cnd_timedwait(&q->cond, &q->mutex, timeout) == thrd_timedout) {
-            mtx_unlock(&q->mutex);
-            return mpsc_TIMEOUT;
-        }
+    const enum mpsc_error err = mpsc_queue_wait_locked(q, timeout);
+    if (err != mpsc_OK) {
+        mtx_unlock(&q->mutex);
+        return err;
     }
+    mpsc_queue_pop_locked(q, NULL, data);
     mtx_unlock(&q->mutex);
-    return mpsc_queue_pop(q, data);
+    cnd_signal(&q->cond);
+    return mpsc_OK;
+}
+
+int mpsc_receiver_numa_pin(struct mpsc_receiver *receiver) {
+    struct mpsc_queue *q = mpsc_shared_queue_get(receiver->queue);
+    if (q->numa_node == MPSC_NUMA_NONE) { return -1; }
+    return mpsc_numa_pin_thread(q->numa_node);
+}
+
+size_t mpsc_receiver_recv_batch(
+    struct mpsc_receiver *receiver, void *data, size_t max
+) {
+    return mpsc_queue_pop_batch(mpsc_shared_queue_get(receiver->queue), data, max);
 }
 
 struct mpsc_sender* mpsc_sender_new(struct mpsc_shared_queue queue) {
@@ -438,7 +1844,8 @@ struct mpsc_sender* mpsc_sender_clone(struct mpsc_sender *sender) {
 void mpsc_sender_drop(struct mpsc_sender *sender) {
     struct mpsc_queue *queue = mpsc_shared_queue_get(sender->queue);
     if (atomic_fetch_sub(&queue->senders, 1) == 1) {
-        cnd_signal(&queue->cond);
+        // Pipeline stages can have multiple threads receiving.
+        cnd_broadcast(&queue->cond);
     }
     mpsc_shared_queue_drop(sender->queue);
     memset(sender, 0, sizeof(*sender));
@@ -451,6 +1858,288 @@ enum mpsc_error mpsc_sender_send(struct mpsc_sender *sender, const void *data) {
     mpsc_queue_push(q, data);
     return mpsc_OK;
 }
+
+enum mpsc_error mpsc_sender_send_keyed(
+    struct mpsc_sender *sender, uint64_t key, const void *data
+) {
+    struct mpsc_queue *q = mpsc_shared_queue_get(sender->queue);
+    if (mpsc_queue_closed(q)) { return mpsc_CLOSED; }
+    mpsc_queue_push_keyed(q, key, data);
+    return mpsc_OK;
+}
+
+enum mpsc_error mpsc_sender_send_at(
+    struct mpsc_sender *sender, const void *data, const struct timespec *deadline
+) {
+    struct mpsc_queue *q = mpsc_shared_queue_get(sender->queue);
+    if (mpsc_queue_closed(q)) { return mpsc_CLOSED; }
+    mpsc_queue_push_at(q, data, deadline);
+    return mpsc_OK;
+}
+
+enum mpsc_error mpsc_sender_send_batch(
+    struct mpsc_sender *sender, const void *data, size_t count
+) {
+    struct mpsc_queue *q = mpsc_shared_queue_get(sender->queue);
+    if (mpsc_queue_closed(q)) { return mpsc_CLOSED; }
+    mpsc_queue_push_batch(q, data, count);
+    return mpsc_OK;
+}
+
+struct mpsc_pipeline* mpsc_pipeline_new(int pin) {
+#ifndef MPSC__NUMA
+    if (pin) {
+        return NULL;
+    }
+#endif
+    struct mpsc_pipeline *p = (struct mpsc_pipeline*)malloc(sizeof(*p));
+    p->stages = NULL;
+    p->stage_count = 0;
+    p->stage_capacity = 0;
+    timespec_get(&p->start, TIME_UTC);
+    p->pin = pin;
+    atomic_init(&p->next_cpu, 0);
+    return p;
+}
+
+size_t mpsc_pipeline_add_stage(
+    struct mpsc_pipeline *pipeline, mpsc_stage_fn fn, void *context,
+    size_t threads, size_t max_threads,
+    struct mpsc_receiver *input, struct mpsc_sender *output
+) {
+    if (pipeline->stage_count == pipeline->stage_capacity) {
+        pipeline->stage_capacity = pipeline->stage_capacity
+            ? pipeline->stage_capacity * 2
+            : 4;
+        pipeline->stages = (struct mpsc_stage**)realloc(
+            pipeline->stages, pipeline->stage_capacity * sizeof(*pipeline->stages)
+        );
+    }
+    struct mpsc_stage *stage = (struct mpsc_stage*)malloc(sizeof(*stage));
+    stage->fn = fn;
+    stage->context = context;
+    stage->input = input;
+    stage->output = output;
+    stage->pipeline = pipeline;
+    mtx_init(&stage->mutex, mtx_plain);
+    if (threads == 0) {
+        threads = 1;
+    }
+    stage->max_threads = max_threads < threads ? threads : max_threads;
+    stage->threads = (thrd_t*)calloc(stage->max_threads, sizeof(thrd_t));
+    stage->thread_count = 0;
+    stage->running = threads;
+    stage->started = 0;
+    atomic_init(&stage->processed, 0);
+    atomic_init(&stage->unpinned, 0);
+    stage->window_processed = 0;
+    stage->window_start = pipeline->start;
+    pipeline->stages[pipeline->stage_count] = stage;
+    return pipeline->stage_count++;
+}
+
+/// Drops the input and output of the stage once its last thread exits.
+static void mpsc_stage_finish(struct mpsc_stage *stage) {
+    if (stage->input) {
+        mpsc_receiver_drop(stage->input);
+        stage->input = NULL;
+    }
+    if (stage->output) {
+        mpsc_sender_drop(stage->output);
+        stage->output = NULL;
+    }
+}
+
+static int mpsc_stage_worker(void *arg) {
+    struct mpsc_stage *stage = (struct mpsc_stage*)arg;
+    if (stage->pipeline->pin
+        && mpsc_pin_thread(atomic_fetch_add(&stage->pipeline->next_cpu, 1)) != 0) {
+        atomic_fetch_add(&stage->unpinned, 1);
+    }
+    // The input and output are only dropped once all threads exit so they
+    // stay valid here.
+    struct mpsc_receiver *input = stage->input;
+    struct mpsc_sender *output = stage->output;
+    const size_t in_size = mpsc_shared_queue_get(input->queue)->datasize;
+    const size_t out_size
+        = output ? mpsc_shared_queue_get(output->queue)->datasize : 0;
+    char *in = (char*)malloc(in_size * MPSC_PIPELINE_BATCH);
+    char *out = output ? (char*)malloc(out_size * MPSC_PIPELINE_BATCH) : NULL;
+    size_t count;
+    while ((count = mpsc_receiver_recv_batch(input, in, MPSC_PIPELINE_BATCH))) {
+        size_t out_count = 0;
+        for (size_t i = 0; i < count; i++) {
+            void *item_out = output ? out + out_count * out_size : NULL;
+            if (stage->fn(stage->context, in + i * in_size, item_out) && output) {
+                ++out_count;
+            }
+        }
+        atomic_fetch_add(&stage->processed, count);
+        if (out_count
+            && mpsc_sender_send_batch(output, out, out_count) == mpsc_CLOSED) {
+            // Nobody is receiving our output anymore.
+            break;
+        }
+    }
+    free(in);
+    free(out);
+    mtx_lock(&stage->mutex);
+    if (--stage->running == 0) {
+        mpsc_stage_finish(stage);
+    }
+    mtx_unlock(&stage->mutex);
+    return 0;
+}
+
+/// Starts a thread for the stage, `running` must already include it and is
+/// decremented again if the thread could not be created.  The stage must be
+/// locked.  Returns -1 on failure.
+static int mpsc_stage_spawn(struct mpsc_stage *stage) {
+    if (thrd_create(&stage->threads[stage->thread_count], mpsc_stage_worker, stage)
+        != thrd_success) {
+        --stage->running;
+        return -1;
+    }
+    ++stage->thread_count;
+    return 0;
+}
+
+int mpsc_pipeline_start(struct mpsc_pipeline *pipeline) {
+    int result = 0;
+    timespec_get(&pipeline->start, TIME_UTC);
+    for (size_t i = 0; i < pipeline->stage_count; i++) {
+        struct mpsc_stage *stage = pipeline->stages[i];
+        mtx_lock(&stage->mutex);
+        stage->started = 1;
+        stage->window_start = pipeline->start;
+        const size_t threads = stage->running;
+        for (size_t t = 0; t < threads; t++) {
+            if (mpsc_stage_spawn(stage) != 0) {
+                result = -1;
+            }
+        }
+        // Workers only decrement `running` with the lock held, so this is only
+        // zero if none of them could be created.
+        if (stage->running == 0) {
+            mpsc_stage_finish(stage);
+        }
+        mtx_unlock(&stage->mutex);
+    }
+    return result;
+}
+
+void mpsc_pipeline_join(struct mpsc_pipeline *pipeline) {
+    for (size_t i = 0; i < pipeline->stage_count; i++) {
+        struct mpsc_stage *stage = pipeline->stages[i];
+        // Threads may be added by `mpsc_pipeline_rebalance` while we wait.
+        for (size_t t = 0;; t++) {
+            mtx_lock(&stage->mutex);
+            const int done = t >= stage->thread_count;
+            mtx_unlock(&stage->mutex);
+            if (done) {
+                break;
+            }
+            thrd_join(stage->threads[t], NULL);
+        }
+    }
+}
+
+void mpsc_pipeline_drop(struct mpsc_pipeline *pipeline) {
+    for (size_t i = 0; i < pipeline->stage_count; i++) {
+        struct mpsc_stage *stage = pipeline->stages[i];
+        mpsc_stage_finish(stage);
+        mtx_destroy(&stage->mutex);
+        free(stage->threads);
+        free(stage);
+    }
+    free(pipeline->stages);
+    free(pipeline);
+}
+
+/// Returns the number of items waiting in the input of the stage, which must
+/// be locked.
+static size_t mpsc_stage_depth(struct mpsc_stage *stage) {
+    return stage->input
+        ? mpsc_queue_depth(mpsc_shared_queue_get(stage->input->queue))
+        : 0;
+}
+
+void mpsc_pipeline_stats(
+    struct mpsc_pipeline *pipeline, size_t stage_index, struct mpsc_stage_stats *stats
+) {
+    struct mpsc_stage *stage = pipeline->stages[stage_index];
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    mtx_lock(&stage->mutex);
+    const double elapsed = (double)(now.tv_sec - stage->window_start.tv_sec)
+        + (double)(now.tv_nsec - stage->window_start.tv_nsec) / 1e9;
+    stats->threads = stage->running;
+    stats->depth = mpsc_stage_depth(stage);
+    stats->processed = atomic_load(&stage->processed);
+    stats->unpinned = atomic_load(&stage->unpinned);
+    stats->throughput = elapsed > 0
+        ? (double)(stats->processed - stage->window_processed) / elapsed
+        : 0;
+    stage->window_processed = stats->processed;
+    stage->window_start = now;
+    mtx_unlock(&stage->mutex);
+}
+
+size_t mpsc_pipeline_bottleneck(struct mpsc_pipeline *pipeline) {
+    size_t result = 0;
+    size_t max_depth = 0;
+    for (size_t i = 0; i < pipeline->stage_count; i++) {
+        struct mpsc_stage *stage = pipeline->stages[i];
+        mtx_lock(&stage->mutex);
+        const size_t depth = mpsc_stage_depth(stage);
+        mtx_unlock(&stage->mutex);
+        if (depth > max_depth) {
+            max_depth = depth;
+            result = i;
+        }
+    }
+    return result;
+}
+
+/// Whether another thread can be added to the stage, which must be locked.
+/// A stage without running threads has finished and already dropped its input
+/// and output.
+static int mpsc_stage_can_grow(struct mpsc_stage *stage) {
+    return stage->started && stage->running
+        && stage->thread_count < stage->max_threads;
+}
+
+long mpsc_pipeline_rebalance(struct mpsc_pipeline *pipeline) {
+    long best = -1;
+    size_t max_depth = 0;
+    for (size_t i = 0; i < pipeline->stage_count; i++) {
+        struct mpsc_stage *stage = pipeline->stages[i];
+        mtx_lock(&stage->mutex);
+        const size_t depth = mpsc_stage_can_grow(stage) ? mpsc_stage_depth(stage) : 0;
+        mtx_unlock(&stage->mutex);
+        if (depth > max_depth) {
+            max_depth = depth;
+            best = (long)i;
+        }
+    }
+    if (best < 0) {
+        return -1;
+    }
+    struct mpsc_stage *stage = pipeline->stages[best];
+    mtx_lock(&stage->mutex);
+    // The stage may have finished in the meantime.
+    if (!mpsc_stage_can_grow(stage)) {
+        best = -1;
+    } else {
+        ++stage->running;
+        if (mpsc_stage_spawn(stage) != 0) {
+            // The other threads are still running, so the stage is not done.
+            best = -1;
+        }
+    }
+    mtx_unlock(&stage->mutex);
+    return best;
+}
 #endif
 
 #ifdef __cplusplus
@@ -5,6 +5,8 @@
 #endif
 #include <smallunit.h>
 
+// Small spill segments so the tests go through several of them.
+#define MPSC_SPILL_SEGMENT_SIZE 4096
 #define MPSC_IMPLEMENTATION
 #include "mpsc.h"
 
@@ -195,10 +197,603 @@ su_module(async, {
     })
 });
 
+su_module(numa, {
+    SENDER(int) tx;
+    RECEIVER(int) rx;
+    int i = NONE;
+
+    su_test("numa channel", {
+        MPSC_CHANNEL_NUMA(tx, rx, MPSC_NUMA_LOCAL);
+        su_assert_eq(MPSC_SEND(tx, VALUE), mpsc_OK);
+        MPSC_DROP_SENDER(tx);
+        i = NONE;
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(i, VALUE);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_CLOSED);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("chunk allocation", {
+        enum { COUNT = MPSC_NUMA_CHUNK_NODES * 3 + 1 };
+        // Force the chunked allocation even on single node systems.
+        struct mpsc_queue *q = mpsc_queue_new(sizeof(int));
+        q->numa_node = 0;
+        q->senders = 1;
+        q->receivers = 1;
+        for (int n = 0; n < COUNT; n++) {
+            mpsc_queue_push(q, &n);
+        }
+        for (int n = 0; n < COUNT; n++) {
+            su_assert_eq(mpsc_queue_pop(q, &i), mpsc_OK);
+            su_assert_eq(i, n);
+        }
+        su_assert(q->chunks != NULL);
+#ifdef MPSC__NUMA
+        // Built with MPSC_NUMA the chunks are mapped and bound.
+        su_assert(q->chunks->mapped);
+#endif
+        mpsc_queue_drop(q);
+    })
+
+#ifdef MPSC__NUMA
+    su_test("read node list", {
+        const char *path = "mpsc_test_node_list";
+        FILE *f = fopen(path, "w");
+        fputs("0-3,8,10-11\n", f);
+        fclose(f);
+        int max = -1;
+        su_assert_eq(mpsc_numa_read_list(path, mpsc_numa_max, &max), 3);
+        su_assert_eq(max, 11);
+        struct mpsc_numa_mask mask = {{0}};
+        mpsc_numa_read_list(path, mpsc_numa_mask_set, &mask);
+        remove(path);
+        su_assert_eq(mask.bits[0], 0xD0FUL);
+    })
+
+    su_test("node topology", {
+        su_assert(mpsc_numa_node_count() >= 1);
+        const int node = mpsc_numa_current_node();
+        su_assert(node >= 0 && node < mpsc_numa_node_count());
+        su_assert_eq(mpsc_numa_pin_thread(node), 0);
+        su_assert_eq(mpsc_numa_pin_thread(-1), -1);
+    })
+
+    su_test("pin to allowed CPUs", {
+        const int long_bits = 8 * sizeof(unsigned long);
+        su_assert_eq(mpsc_pin_thread(0), 0);
+        for (unsigned cpu = 0; cpu < 2u * (unsigned)mpsc_allowed_cpu_count + 1; cpu++) {
+            su_assert_eq(mpsc_pin_thread(cpu), 0);
+            struct mpsc_numa_mask mask = {{0}};
+            syscall(SYS_sched_getaffinity, 0, sizeof(mask.bits), mask.bits);
+            int pinned = 0;
+            for (int n = 0; n < MPSC__MASK_BITS; n++) {
+                const unsigned long bit = 1UL << (n % long_bits);
+                if (mask.bits[n / long_bits] & bit) {
+                    su_assert(mpsc_allowed_cpus.bits[n / long_bits] & bit);
+                    ++pinned;
+                }
+            }
+            su_assert_eq(pinned, 1);
+        }
+        // Don't keep the test thread on one CPU.
+        su_assert_eq(mpsc_set_affinity(&mpsc_allowed_cpus), 0);
+    })
+#endif
+});
+
+su_module(keyed, {
+    SENDER(int) tx;
+    RECEIVER(int) rx;
+    int i = NONE;
+    uint64_t key = 0;
+
+    su_test("conflate same key", {
+        MPSC_CHANNEL_KEYED(tx, rx);
+        for (int n = 0; n < 10; n++) {
+            su_assert_eq(MPSC_SEND_KEYED(tx, 1, n), mpsc_OK);
+        }
+        su_assert_eq(MPSC_RECV_KEYED(rx, key, i), mpsc_OK);
+        su_assert_eq(key, 1);
+        su_assert_eq(i, 9);
+        su_assert_eq(MPSC_TRY_RECV(rx, i), mpsc_EMPTY);
+        MPSC_DROP_SENDER(tx);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("first dirtied order", {
+        MPSC_CHANNEL_KEYED(tx, rx);
+        // Enough keys to grow the hash table.
+        enum { KEYS = 100 };
+        for (int round = 0; round < 3; round++) {
+            for (int n = 0; n < KEYS; n++) {
+                int value = n * 10 + round;
+                MPSC_SEND_KEYED(tx, (uint64_t)n, value);
+            }
+        }
+        MPSC_DROP_SENDER(tx);
+        for (int n = 0; n < KEYS; n++) {
+            su_assert_eq(MPSC_RECV_KEYED(rx, key, i), mpsc_OK);
+            su_assert_eq(key, (uint64_t)n);
+            su_assert_eq(i, n * 10 + 2);
+        }
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_CLOSED);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("key is dirty again after recv", {
+        MPSC_CHANNEL_KEYED(tx, rx);
+        int a = 1, b = 2;
+        MPSC_SEND_KEYED(tx, 5, a);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(i, a);
+        MPSC_SEND_KEYED(tx, 5, b);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(i, b);
+        MPSC_DROP_SENDER(tx);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("unkeyed send is not conflated", {
+        MPSC_CHANNEL_KEYED(tx, rx);
+        MPSC_SEND(tx, VALUE);
+        MPSC_SEND(tx, VALUE);
+        MPSC_DROP_SENDER(tx);
+        su_assert_eq(MPSC_RECV_KEYED(rx, key, i), mpsc_OK);
+        su_assert_eq(key, 0);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_CLOSED);
+        MPSC_DROP_RECEIVER(rx);
+    })
+});
+
+static struct timespec deadline_in(long ms) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+su_module(delayed, {
+    SENDER(int) tx;
+    RECEIVER(int) rx;
+    int i = NONE;
+
+    su_test("deadline order", {
+        MPSC_CHANNEL(tx, rx);
+        const struct timespec later = deadline_in(SHORTMS);
+        const struct timespec soon = deadline_in(SHORTMS / 2);
+        int a = 1, b = 2, c = 3;
+        su_assert_eq(MPSC_SEND_AT(tx, a, &later), mpsc_OK);
+        su_assert_eq(MPSC_SEND_AT(tx, b, &soon), mpsc_OK);
+        su_assert_eq(MPSC_SEND(tx, c), mpsc_OK);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(i, c);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(i, b);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(i, a);
+        MPSC_DROP_SENDER(tx);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("many deadlines", {
+        enum { COUNT = 100 };
+        MPSC_CHANNEL(tx, rx);
+        for (int n = 0; n < COUNT; n++) {
+            // Deadlines in the past, sent in a scrambled order.
+            int value = (n * 37) % COUNT;
+            const struct timespec deadline = {1, value * 1000};
+            MPSC_SEND_AT(tx, value, &deadline);
+        }
+        for (int n = 0; n < COUNT; n++) {
+            su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+            su_assert_eq(i, n);
+        }
+        MPSC_DROP_SENDER(tx);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("not due yet", {
+        MPSC_CHANNEL(tx, rx);
+        const struct timespec later = deadline_in(SHORTMS);
+        su_assert_eq(MPSC_SEND_AT(tx, VALUE, &later), mpsc_OK);
+        i = NONE;
+        su_assert_eq(MPSC_TRY_RECV(rx, i), mpsc_EMPTY);
+        const struct timespec timeout = deadline_in(SHORTMS / 2);
+        su_assert_eq(MPSC_RECV_TIMEOUT(rx, i, &timeout), mpsc_TIMEOUT);
+        su_assert_eq(i, NONE);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(i, VALUE);
+        MPSC_DROP_SENDER(tx);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("deadline equal to timeout", {
+        MPSC_CHANNEL(tx, rx);
+        const struct timespec deadline = deadline_in(SHORTMS / 2);
+        su_assert_eq(MPSC_SEND_AT(tx, VALUE, &deadline), mpsc_OK);
+        i = NONE;
+        su_assert_eq(MPSC_RECV_TIMEOUT(rx, i, &deadline), mpsc_OK);
+        su_assert_eq(i, VALUE);
+        MPSC_DROP_SENDER(tx);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("delayed data outlives senders", {
+        MPSC_CHANNEL(tx, rx);
+        const struct timespec later = deadline_in(SHORTMS);
+        su_assert_eq(MPSC_SEND_AT(tx, VALUE, &later), mpsc_OK);
+        MPSC_DROP_SENDER(tx);
+        i = NONE;
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+        su_assert_eq(i, VALUE);
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_CLOSED);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("pending delayed data is freed", {
+        MPSC_CHANNEL(tx, rx);
+        const struct timespec later = deadline_in(SHORTMS * 10);
+        su_assert_eq(MPSC_SEND_AT(tx, VALUE, &later), mpsc_OK);
+        MPSC_DROP_SENDER(tx);
+        MPSC_DROP_RECEIVER(rx);
+    })
+});
+
+static atomic_int spill_io_held;
+
+// Holds the spill file lock for a while like a slow disk would.
+static int hold_spill_io(struct mpsc_spill *spill) {
+    mtx_lock(&spill->io);
+    atomic_store(&spill_io_held, 1);
+    thrd_sleep(&SHORT, NULL);
+    mtx_unlock(&spill->io);
+    return 0;
+}
+
+su_module(spill, {
+    SENDER(int) tx;
+    RECEIVER(int) rx;
+    int i = NONE;
+    enum { THRESHOLD = 4, COUNT = MPSC_SPILL_BATCH * 3 + 7 };
+
+    su_test("spilled data keeps order", {
+        MPSC_CHANNEL_SPILL(tx, rx, THRESHOLD, NULL);
+        for (int n = 0; n < COUNT; n++) {
+            su_assert_eq(MPSC_SEND(tx, n), mpsc_OK);
+        }
+        struct mpsc_queue *q = mpsc_shared_queue_get(((struct mpsc_receiver*)rx)->queue);
+        su_assert_eq(q->length, THRESHOLD);
+        MPSC_DROP_SENDER(tx);
+        for (int n = 0; n < COUNT; n++) {
+            su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+            su_assert_eq(i, n);
+        }
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_CLOSED);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("interleaved send and recv", {
+        MPSC_CHANNEL_SPILL(tx, rx, THRESHOLD, "mpsc_test_spill");
+        int sent = 0, received = 0;
+        for (int round = 0; round < 10; round++) {
+            for (int n = 0; n < COUNT / 5; n++, sent++) {
+                su_assert_eq(MPSC_SEND(tx, sent), mpsc_OK);
+            }
+            for (int n = 0; n < COUNT / 10; n++, received++) {
+                // Not TRY_RECV, the data may still be getting written.
+                su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+                su_assert_eq(i, received);
+            }
+        }
+        MPSC_DROP_SENDER(tx);
+        while (MPSC_RECV(rx, i) == mpsc_OK) {
+            su_assert_eq(i, received);
+            ++received;
+        }
+        su_assert_eq(received, sent);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("segments are reused under a steady backlog", {
+        enum { BACKLOG = 2000, STEP = 300, ROUNDS = 200 };
+        MPSC_CHANNEL_SPILL(tx, rx, THRESHOLD, NULL);
+        struct mpsc_queue *q = mpsc_shared_queue_get(((struct mpsc_receiver*)rx)->queue);
+        int sent = 0, received = 0;
+        for (; sent < BACKLOG; sent++) {
+            MPSC_SEND(tx, sent);
+        }
+        size_t max_segments = 0;
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int n = 0; n < STEP; n++, sent++) {
+                MPSC_SEND(tx, sent);
+            }
+            for (int n = 0; n < STEP; n++, received++) {
+                su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+                su_assert_eq(i, received);
+            }
+            mtx_lock(&q->mutex);
+            size_t segments = 0;
+            for (struct mpsc_spill_segment *s = q->spill->segments; s; s = s->next) {
+                ++segments;
+            }
+            mtx_unlock(&q->mutex);
+            if (segments > max_segments) {
+                max_segments = segments;
+            }
+        }
+        // Bounded by the backlog, not by how much was sent in total.
+        const size_t bound = (BACKLOG + STEP) / q->spill->segment_records + 2;
+        su_assert(max_segments <= bound);
+        su_assert_eq(mpsc_queue_depth(q), BACKLOG);
+        MPSC_DROP_SENDER(tx);
+        while (MPSC_RECV(rx, i) == mpsc_OK) {
+            su_assert_eq(i, received);
+            ++received;
+        }
+        su_assert_eq(received, sent);
+        MPSC_DROP_RECEIVER(rx);
+    })
+
+    su_test("several segments retire before the drop", {
+        // Large records so every batch needs a segment of its own.
+        struct big { int n; char pad[8188]; } big = {0};
+        enum { BIG_COUNT = MPSC_SPILL_BATCH * 8 };
+        for (int round = 0; round < 10; round++) {
+            SENDER(struct big) btx;
+            RECEIVER(struct big) brx;
+            MPSC_CHANNEL_SPILL(btx, brx, 0, NULL);
+            for (big.n = 0; big.n < BIG_COUNT; big.n++) {
+                su_assert_eq(MPSC_SEND(btx, big), mpsc_OK);
+            }
+            MPSC_DROP_SENDER(btx);
+            for (int n = 0; n < BIG_COUNT; n++) {
+                su_assert_eq(MPSC_RECV(brx, big), mpsc_OK);
+                su_assert_eq(big.n, n);
+            }
+            su_assert_eq(MPSC_RECV(brx, big), mpsc_CLOSED);
+            MPSC_DROP_RECEIVER(brx);
+        }
+    })
+
+    su_test("close waits for the writer", {
+        thrd_t thread;
+        MPSC_CHANNEL_SPILL(tx, rx, 0, NULL);
+        struct mpsc_queue *q = mpsc_shared_queue_get(((struct mpsc_receiver*)rx)->queue);
+        atomic_store(&spill_io_held, 0);
+        thrd_create(&thread, (thrd_start_t)hold_spill_io, q->spill);
+        while (!atomic_load(&spill_io_held)) {
+            thrd_yield();
+        }
+        for (int n = 0; n < MPSC_SPILL_BATCH; n++) {
+            su_assert_eq(MPSC_SEND(tx, n), mpsc_OK);
+        }
+        // Wait until the writer is stuck writing the only batch.
+        for (int writing = 0; !writing; ) {
+            mtx_lock(&q->mutex);
+            writing = q->spill->writing;
+            mtx_unlock(&q->mutex);
+        }
+        MPSC_DROP_SENDER(tx);
+        for (int n = 0; n < MPSC_SPILL_BATCH; n++) {
+            su_assert_eq(MPSC_RECV(rx, i), mpsc_OK);
+            su_assert_eq(i, n);
+        }
+        su_assert_eq(MPSC_RECV(rx, i), mpsc_CLOSED);
+        MPSC_DROP_RECEIVER(rx);
+        thrd_join(thread, NULL);
+    })
+
+    su_test("spill with lots of senders", {
+        enum { THREADS = 100 };
+        thrd_t *threads = (thrd_t *)calloc(THREADS, sizeof(thrd_t));
+        MPSC_CHANNEL_SPILL(tx, rx, THRESHOLD, NULL);
+        for (int t = 0; t < THREADS; t++) {
+            thrd_create(&threads[t], (thrd_start_t)send_data_immidiately, MPSC_CLONE(tx));
+        }
+        MPSC_DROP_SENDER(tx);
+        int count = 0;
+        while (MPSC_RECV(rx, i) == mpsc_OK) {
+            su_assert_eq(i, VALUE);
+            ++count;
+        }
+        su_assert_eq(count, THREADS);
+        MPSC_DROP_RECEIVER(rx);
+        for (int t = 0; t < THREADS; t++) {
+            thrd_join(threads[t], NULL);
+        }
+        free(threads);
+    })
+});
+
+static int square(void *context, const void *input, void *output) {
+    (void)context;
+    const int i = *(const int*)input;
+    *(int*)output = i * i;
+    // Only pass on even squares.
+    return i % 2 == 0;
+}
+
+static int add_to(void *context, const void *input, void *output) {
+    if (output) {
+        // Sinks don't get an output.
+        abort();
+    }
+    atomic_fetch_add((atomic_long*)context, *(const int*)input);
+    return 0;
+}
+
+static atomic_int blocked_stage_released;
+
+static int blocked_stage(void *context, const void *input, void *output) {
+    (void)context;
+    while (!atomic_load(&blocked_stage_released)) {
+        thrd_yield();
+    }
+    *(int*)output = *(const int*)input;
+    return 1;
+}
+
+su_module(pipeline, {
+    SENDER(int) tx;
+    RECEIVER(int) rx;
+    SENDER(int) mid_tx;
+    RECEIVER(int) mid_rx;
+    int i = NONE;
+    enum { COUNT = 1000 };
+
+    su_test("stages", {
+        atomic_long sum = 0;
+        MPSC_CHANNEL(tx, rx);
+        MPSC_CHANNEL(mid_tx, mid_rx);
+        struct mpsc_pipeline *p = mpsc_pipeline_new(0);
+        MPSC_PIPELINE_ADD_STAGE(p, square, NULL, 3, 3, rx, mid_tx);
+        MPSC_PIPELINE_ADD_SINK(p, add_to, &sum, 1, 1, mid_rx);
+        su_assert(rx == NULL && mid_tx == NULL && mid_rx == NULL);
+        su_assert_eq(mpsc_pipeline_start(p), 0);
+        long expected = 0;
+        for (int n = 0; n < COUNT; n++) {
+            MPSC_SEND(tx, n);
+            if (n % 2 == 0) {
+                expected += n * n;
+            }
+        }
+        MPSC_DROP_SENDER(tx);
+        mpsc_pipeline_join(p);
+        su_assert_eq(atomic_load(&sum), expected);
+        struct mpsc_stage_stats stats;
+        mpsc_pipeline_stats(p, 0, &stats);
+        su_assert_eq(stats.processed, COUNT);
+        su_assert_eq(stats.threads, 0);
+        su_assert(stats.throughput > 0);
+        // Nothing was processed since the last call.
+        mpsc_pipeline_stats(p, 0, &stats);
+        su_assert_eq(stats.throughput, 0);
+        mpsc_pipeline_stats(p, 1, &stats);
+        su_assert_eq(stats.processed, COUNT / 2);
+        su_assert_eq(stats.depth, 0);
+        mpsc_pipeline_drop(p);
+    })
+
+    su_test("close propagates to the output", {
+        MPSC_CHANNEL(tx, rx);
+        MPSC_CHANNEL(mid_tx, mid_rx);
+        struct mpsc_pipeline *p = mpsc_pipeline_new(0);
+        MPSC_PIPELINE_ADD_STAGE(p, square, NULL, 2, 2, rx, mid_tx);
+        su_assert_eq(mpsc_pipeline_start(p), 0);
+        int value = 4;
+        MPSC_SEND(tx, value);
+        MPSC_DROP_SENDER(tx);
+        su_assert_eq(MPSC_RECV(mid_rx, i), mpsc_OK);
+        su_assert_eq(i, 16);
+        su_assert_eq(MPSC_RECV(mid_rx, i), mpsc_CLOSED);
+        mpsc_pipeline_join(p);
+        mpsc_pipeline_drop(p);
+        MPSC_DROP_RECEIVER(mid_rx);
+    })
+
+    su_test("rebalance", {
+        atomic_store(&blocked_stage_released, 0);
+        MPSC_CHANNEL(tx, rx);
+        MPSC_CHANNEL(mid_tx, mid_rx);
+        struct mpsc_pipeline *p = mpsc_pipeline_new(0);
+        MPSC_PIPELINE_ADD_STAGE(p, blocked_stage, NULL, 1, 2, rx, mid_tx);
+        su_assert_eq(mpsc_pipeline_start(p), 0);
+        for (int n = 0; n < COUNT; n++) {
+            MPSC_SEND(tx, n);
+        }
+        struct mpsc_stage_stats stats;
+        mpsc_pipeline_stats(p, 0, &stats);
+        su_assert(stats.depth > 0);
+        su_assert_eq(mpsc_pipeline_bottleneck(p), 0);
+        su_assert_eq(mpsc_pipeline_rebalance(p), 0);
+        // At the thread limit.
+        su_assert_eq(mpsc_pipeline_rebalance(p), -1);
+        mpsc_pipeline_stats(p, 0, &stats);
+        su_assert_eq(stats.threads, 2);
+        atomic_store(&blocked_stage_released, 1);
+        MPSC_DROP_SENDER(tx);
+        int count = 0;
+        while (MPSC_RECV(mid_rx, i) == mpsc_OK) {
+            ++count;
+        }
+        su_assert_eq(count, COUNT);
+        mpsc_pipeline_join(p);
+        mpsc_pipeline_drop(p);
+        MPSC_DROP_RECEIVER(mid_rx);
+    })
+
+    su_test("pinning", {
+#ifdef MPSC__NUMA
+        atomic_long sum = 0;
+        MPSC_CHANNEL(tx, rx);
+        struct mpsc_pipeline *p = mpsc_pipeline_new(1);
+        su_assert(p != NULL);
+        MPSC_PIPELINE_ADD_SINK(p, add_to, &sum, 2, 2, rx);
+        su_assert_eq(mpsc_pipeline_start(p), 0);
+        MPSC_SEND(tx, VALUE);
+        MPSC_DROP_SENDER(tx);
+        mpsc_pipeline_join(p);
+        struct mpsc_stage_stats stats;
+        mpsc_pipeline_stats(p, 0, &stats);
+        su_assert_eq(stats.unpinned, 0);
+        su_assert_eq(atomic_load(&sum), VALUE);
+        mpsc_pipeline_drop(p);
+#else
+        // Pinning is not supported without MPSC_NUMA.
+        su_assert(mpsc_pipeline_new(1) == NULL);
+#endif
+    })
+
+    su_test("rebalance skips stages at their limit", {
+        SENDER(int) tx2;
+        RECEIVER(int) rx2;
+        SENDER(int) out2_tx;
+        RECEIVER(int) out2_rx;
+        atomic_store(&blocked_stage_released, 0);
+        MPSC_CHANNEL(tx, rx);
+        MPSC_CHANNEL(mid_tx, mid_rx);
+        MPSC_CHANNEL(tx2, rx2);
+        MPSC_CHANNEL(out2_tx, out2_rx);
+        struct mpsc_pipeline *p = mpsc_pipeline_new(0);
+        MPSC_PIPELINE_ADD_STAGE(p, blocked_stage, NULL, 1, 1, rx, mid_tx);
+        MPSC_PIPELINE_ADD_STAGE(p, blocked_stage, NULL, 1, 2, rx2, out2_tx);
+        su_assert_eq(mpsc_pipeline_start(p), 0);
+        for (int n = 0; n < COUNT; n++) {
+            MPSC_SEND(tx, n);
+            if (n < COUNT / 4) {
+                MPSC_SEND(tx2, n);
+            }
+        }
+        su_assert_eq(mpsc_pipeline_bottleneck(p), 0);
+        su_assert_eq(mpsc_pipeline_rebalance(p), 1);
+        su_assert_eq(mpsc_pipeline_rebalance(p), -1);
+        atomic_store(&blocked_stage_released, 1);
+        MPSC_DROP_SENDER(tx);
+        MPSC_DROP_SENDER(tx2);
+        while (MPSC_RECV(mid_rx, i) == mpsc_OK) {}
+        while (MPSC_RECV(out2_rx, i) == mpsc_OK) {}
+        mpsc_pipeline_join(p);
+        mpsc_pipeline_drop(p);
+        MPSC_DROP_RECEIVER(mid_rx);
+        MPSC_DROP_RECEIVER(out2_rx);
+    })
+});
+
 int main(void) {
     SUResult res = su_new_result();
     su_add_result(&res, su_run_module(sync));
     su_add_result(&res, su_run_module(async));
+    su_add_result(&res, su_run_module(numa));
+    su_add_result(&res, su_run_module(keyed));
+    su_add_result(&res, su_run_module(delayed));
+    su_add_result(&res, su_run_module(spill));
+    su_add_result(&res, su_run_module(pipeline));
     fmt_println("Total:");
     su_print_result(&res);
 }